@@ -1,9 +1,11 @@
 #include "Model.hpp"
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
 #include <unistd.h>
@@ -73,7 +75,8 @@ std::vector<Face> parse_face(std::stringstream &ss) {
   return triangles;
 }
 
-Model::Model(const std::string &filename) {
+Model::Model(const std::string &filename, const TextureLimits &limits)
+    : texture_limits(limits) {
   directory = filename.substr(0, filename.find_last_of("/\\") + 1);
 
   std::ifstream file(filename);
@@ -123,6 +126,61 @@ Model::Model(const std::string &filename) {
   if (!verts.empty()) {
     normalize_verts(*this);
   }
+  build_clusters();
+  build_corners();
+  build_face_normals();
+}
+
+// faces per cluster: enough to keep sorting them per frame cheap, few enough
+// that a cluster rarely spans much depth
+static const int CLUSTER_SIZE = 256;
+
+void Model::build_clusters() {
+  clusters.clear();
+  for (int begin = 0; begin < nfaces(); begin += CLUSTER_SIZE) {
+    int end = std::min(nfaces(), begin + CLUSTER_SIZE);
+    Vec3 lo = vert(begin, 0), hi = lo;
+    for (int f = begin; f < end; f++)
+      for (int i = 0; i < 3; i++)
+        for (int k = 0; k < 3; k++) {
+          lo.data[k] = std::min(lo.data[k], vert(f, i).data[k]);
+          hi.data[k] = std::max(hi.data[k], vert(f, i).data[k]);
+        }
+    clusters.push_back({begin, end,
+                        {(lo.x + hi.x) / 2, (lo.y + hi.y) / 2,
+                         (lo.z + hi.z) / 2}});
+  }
+}
+
+void Model::build_corners() {
+  // a map from vertex and normal index per material
+  std::vector<std::unordered_map<uint64_t, int>> seen(materials.size() + 1);
+  corners.resize(faces.size() * 3);
+  distinct_corners = 0;
+  for (int f = 0; f < nfaces(); f++) {
+    const Face &face = faces[f];
+    auto &lookup = seen[face.material_id + 1];
+    for (int i = 0; i < 3; i++) {
+      uint64_t key = uint64_t(uint32_t(face.v[i])) << 32 | uint32_t(face.vn[i]);
+      corners[3 * f + i] =
+          lookup.emplace(key, distinct_corners).first->second;
+      distinct_corners = std::max(distinct_corners, corners[3 * f + i] + 1);
+    }
+  }
+}
+
+void Model::build_face_normals() {
+  face_normals.resize(faces.size());
+  for (int f = 0; f < nfaces(); f++) {
+    Vec3 a = vert(f, 0), b = vert(f, 1), c = vert(f, 2);
+    Vec3 n = (b - a).cross(c - a);
+    // winding order varies between exporters
+    Vec3 facing = vert_normal(f, 0);
+    facing = facing + vert_normal(f, 1) + vert_normal(f, 2);
+    if (n * facing < 0)
+      n = n * -1;
+    face_normals[f] = n.n();
+  }
 }
 
 void Model::load_mtl(const std::string &filename) {
@@ -163,27 +221,222 @@ void Model::load_mtl(const std::string &filename) {
   }
 }
 
-void Model::load_texture(Material *mat) {
+bool load_image(const std::string &path, Texture &image, int max_size) {
   int w, h, comp;
-  std::string fullpath = directory + mat->diffuse_map;
-  unsigned char *data = stbi_load(fullpath.c_str(), &w, &h, &comp, 0);
-  if (!data) {
-    fprintf(stderr, "failed to load texture: %s\n", fullpath.c_str());
-    return;
-  }
+  unsigned char *data = stbi_load(path.c_str(), &w, &h, &comp, 0);
+  if (!data)
+    return false;
 
-  mat->texture.width = w;
-  mat->texture.height = h;
-  mat->texture.pixels.resize(w * h);
+  // reduced while converting, so only the file's own pixels are ever held
+  // at full size. each texel averages the factor x factor pixels it covers
+  int factor = 1;
+  while (max_size && std::max(w, h) / factor > max_size)
+    factor *= 2;
+  image.resize(std::max(1, w / factor), std::max(1, h / factor));
+  const int n = factor * factor;
 
-  for (int i = 0; i < w * h; i++) {
-    int idx = i * comp;
-    unsigned char r = data[idx + 0];
-    unsigned char g = comp > 1 ? data[idx + 1] : r;
-    unsigned char b = comp > 2 ? data[idx + 2] : r;
-    mat->texture.pixels[i] = {r, g, b};
+  for (int y = 0; y < image.height; y++) {
+    for (int x = 0; x < image.width; x++) {
+      int r = n / 2, g = n / 2, b = n / 2;
+      for (int sy = 0; sy < factor; sy++) {
+        for (int sx = 0; sx < factor; sx++) {
+          int px = std::min(x * factor + sx, w - 1);
+          int py = std::min(y * factor + sy, h - 1);
+          const unsigned char *p = &data[(py * w + px) * comp];
+          r += p[0];
+          g += comp > 1 ? p[1] : p[0];
+          b += comp > 2 ? p[2] : p[0];
+        }
+      }
+      image.set(x, y,
+                {(unsigned char)(r / n), (unsigned char)(g / n),
+                 (unsigned char)(b / n)});
+    }
   }
 
   stbi_image_free(data);
+  return true;
+}
+
+static void from_565(int32_t code, float c[3]) {
+  c[0] = (code >> 11 & 31) * (255 / 31.0f);
+  c[1] = (code >> 5 & 63) * (255 / 63.0f);
+  c[2] = (code & 31) * (255 / 31.0f);
+}
+
+static int32_t to_565(const float c[3]) {
+  auto quantise = [](float v, int levels) {
+    return (int32_t)std::clamp(v * levels / 255 + 0.5f, 0.0f, float(levels));
+  };
+  return quantise(c[0], 31) << 11 | quantise(c[1], 63) << 5 |
+         quantise(c[2], 31);
+}
+
+// endpoints at the extremes of the line that best fits the block's colours,
+// found by power iteration from its bounding box diagonal, and each texel's
+// nearest of the four steps between them
+static void compress_block(const Color texel[16], int32_t block[2]) {
+  float col[16][3], mean[3] = {}, lo[3] = {255, 255, 255}, hi[3] = {};
+  for (int k = 0; k < 16; k++) {
+    col[k][0] = texel[k].r, col[k][1] = texel[k].g, col[k][2] = texel[k].b;
+    for (int c = 0; c < 3; c++) {
+      mean[c] += col[k][c] / 16;
+      lo[c] = std::min(lo[c], col[k][c]);
+      hi[c] = std::max(hi[c], col[k][c]);
+    }
+  }
+  float cov[3][3] = {};
+  for (int k = 0; k < 16; k++)
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++)
+        cov[i][j] += (col[k][i] - mean[i]) * (col[k][j] - mean[j]);
+  float axis[3] = {hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]};
+  for (int step = 0; step < 4; step++) {
+    float next[3], len = 0;
+    for (int i = 0; i < 3; i++) {
+      next[i] = cov[i][0] * axis[0] + cov[i][1] * axis[1] + cov[i][2] * axis[2];
+      len += next[i] * next[i];
+    }
+    if (len < 1e-6f)
+      break;
+    for (int i = 0; i < 3; i++)
+      axis[i] = next[i] / std::sqrt(len);
+  }
+  float len = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] +
+                        axis[2] * axis[2]);
+  if (len > 0)
+    for (float &a : axis)
+      a /= len;
+
+  float tmin = 0, tmax = 0;
+  for (int k = 0; k < 16; k++) {
+    float t = 0;
+    for (int c = 0; c < 3; c++)
+      t += (col[k][c] - mean[c]) * axis[c];
+    tmin = std::min(tmin, t), tmax = std::max(tmax, t);
+  }
+  float e0[3], e1[3];
+  for (int c = 0; c < 3; c++)
+    e0[c] = mean[c] + axis[c] * tmin, e1[c] = mean[c] + axis[c] * tmax;
+  int32_t c0 = to_565(e0), c1 = to_565(e1);
+
+  // weights against the endpoints as they will decode
+  from_565(c0, e0), from_565(c1, e1);
+  float dir[3] = {e1[0] - e0[0], e1[1] - e0[1], e1[2] - e0[2]};
+  float len2 = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+  uint32_t weights = 0;
+  for (int k = 0; k < 16 && len2 > 0; k++) {
+    float t = 0;
+    for (int c = 0; c < 3; c++)
+      t += (col[k][c] - e0[c]) * dir[c];
+    uint32_t w = std::clamp(int(t / len2 * 3 + 0.5f), 0, 3);
+    weights |= w << 2 * k;
+  }
+  block[0] = c0 | c1 << 16;
+  block[1] = weights;
+}
+
+Color Texture::block_at(int x, int y) const {
+  const int32_t *block = &blocks[2 * (y / TILE * tiles_x + x / TILE)];
+  float c0[3], c1[3];
+  from_565(block[0] & 0xffff, c0);
+  from_565(block[0] >> 16 & 0xffff, c1);
+  int k = y % TILE * TILE + x % TILE;
+  float t = (uint32_t(block[1]) >> 2 * k & 3) / 3.0f;
+  unsigned char out[3];
+  for (int c = 0; c < 3; c++)
+    out[c] = (unsigned char)(c0[c] + (c1[c] - c0[c]) * t + 0.5f);
+  return {out[0], out[1], out[2]};
+}
+
+void Texture::compress() {
+  size_t ntiles = tiled.size() / (TILE * TILE);
+  std::vector<int32_t> packed(2 * ntiles);
+  for (size_t t = 0; t < ntiles; t++) {
+    // texels past the edge of a partial tile repeat the edge
+    int x0 = t % tiles_x * TILE, y0 = t / tiles_x * TILE;
+    Color texel[TILE * TILE];
+    for (int k = 0; k < TILE * TILE; k++)
+      texel[k] = at(std::min(x0 + k % TILE, width - 1),
+                    std::min(y0 + k / TILE, height - 1));
+    compress_block(texel, &packed[2 * t]);
+  }
+  blocks = std::move(packed);
+  tiled.clear();
+  tiled.shrink_to_fit();
+  for (Texture &level : mips)
+    level.compress();
+}
+
+size_t Texture::bytes() const {
+  size_t n = tiled.size() * sizeof(int32_t) + blocks.size() * sizeof(int32_t);
+  for (const Texture &level : mips)
+    n += level.bytes();
+  return n;
+}
+
+// each level halves the one above, a texel averaging the 2x2 it covers
+static void build_mips(Texture &tex) {
+  tex.mips.clear();
+  const Texture *above = &tex;
+  while (above->width > 1 || above->height > 1) {
+    Texture level;
+    level.resize(std::max(1, above->width / 2),
+                 std::max(1, above->height / 2));
+    for (int y = 0; y < level.height; y++) {
+      int y0 = 2 * y, y1 = std::min(2 * y + 1, above->height - 1);
+      for (int x = 0; x < level.width; x++) {
+        int x0 = 2 * x, x1 = std::min(2 * x + 1, above->width - 1);
+        Color quad[4] = {above->at(x0, y0), above->at(x1, y0),
+                         above->at(x0, y1), above->at(x1, y1)};
+        int r = 2, g = 2, b = 2;
+        for (const Color &c : quad)
+          r += c.r, g += c.g, b += c.b;
+        level.set(x, y,
+                  {(unsigned char)(r >> 2), (unsigned char)(g >> 2),
+                   (unsigned char)(b >> 2)});
+      }
+    }
+    tex.mips.push_back(std::move(level));
+    above = &tex.mips.back();
+  }
+}
+
+void Model::load_texture(Material *mat) {
+  std::string fullpath = directory + mat->diffuse_map;
+  if (!load_image(fullpath, mat->texture, texture_limits.max_size)) {
+    fprintf(stderr, "failed to load texture: %s\n", fullpath.c_str());
+    return;
+  }
+  build_mips(mat->texture);
+  if (texture_limits.compact)
+    mat->texture.compress();
   mat->has_texture = true;
+  // fitted as each one arrives, so the total never builds up past it
+  fit_texture_budget();
+}
+
+// while the textures exceed the budget, the largest one gives up its top
+// level for the next mip down
+void Model::fit_texture_budget() {
+  if (!texture_limits.budget)
+    return;
+  for (;;) {
+    size_t total = 0, largest_bytes = 0;
+    Texture *largest = nullptr;
+    for (Material &mat : materials) {
+      if (!mat.has_texture)
+        continue;
+      size_t bytes = mat.texture.bytes();
+      total += bytes;
+      if (bytes > largest_bytes)
+        largest = &mat.texture, largest_bytes = bytes;
+    }
+    if (total <= texture_limits.budget || !largest || largest->mips.empty())
+      return;
+    Texture next = std::move(largest->mips.front());
+    next.mips.assign(std::make_move_iterator(largest->mips.begin() + 1),
+                     std::make_move_iterator(largest->mips.end()));
+    *largest = std::move(next);
+  }
 }
@@ -1,5 +1,8 @@
 #pragma once
 #include "geom.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <new>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -8,10 +11,73 @@ struct Color {
   unsigned char r, g, b;
 };
 
+// allocates on 64-byte boundaries, so a vector of them starts a cache line
+template <class T> struct CacheLineAllocator {
+  using value_type = T;
+  CacheLineAllocator() = default;
+  template <class U> CacheLineAllocator(const CacheLineAllocator<U> &) {}
+  T *allocate(size_t n) {
+    void *p = ::operator new(n * sizeof(T), std::align_val_t(64));
+    return static_cast<T *>(p);
+  }
+  void deallocate(T *p, size_t) { ::operator delete(p, std::align_val_t(64)); }
+  bool operator==(const CacheLineAllocator &) const { return true; }
+  bool operator!=(const CacheLineAllocator &) const { return false; }
+};
+
+// texels packed as 0x00bbggrr in 4x4 tiles, a tile per 64-byte cache line,
+// so samples close together in any direction share lines. a compact texture
+// keeps 8 bytes per tile instead: two rgb565 endpoints, then 2 bits per
+// texel of the way from the first to the second in thirds
 struct Texture {
-  int width;
-  int height;
-  std::vector<Color> pixels;
+  static const int TILE = 4;
+
+  int width = 0;
+  int height = 0;
+  int tiles_x = 0; // tiles per row
+  // TILE * TILE texels of each tile in turn, the tiles row by row
+  std::vector<int32_t, CacheLineAllocator<int32_t>> tiled;
+  std::vector<int32_t> blocks; // endpoints and weights of each tile
+  // successively halved copies down to 1x1, mips[0] at half this size
+  std::vector<Texture> mips;
+
+  void resize(int w, int h) {
+    width = w;
+    height = h;
+    tiles_x = (w + TILE - 1) / TILE;
+    tiled.assign(tiles_x * ((h + TILE - 1) / TILE) * TILE * TILE, 0);
+  }
+  const int32_t *texels() const { return tiled.data(); }
+  // offset of texel (x, y) from texels()
+  int index(int x, int y) const {
+    return (y / TILE * tiles_x + x / TILE) * TILE * TILE + y % TILE * TILE +
+           x % TILE;
+  }
+  bool compact() const { return !blocks.empty(); }
+  Color at(int x, int y) const {
+    if (compact())
+      return block_at(x, y);
+    int32_t t = texels()[index(x, y)];
+    return {(unsigned char)t, (unsigned char)(t >> 8),
+            (unsigned char)(t >> 16)};
+  }
+  void set(int x, int y, Color c) {
+    tiled[index(x, y)] = c.r | c.g << 8 | c.b << 16;
+  }
+  Color block_at(int x, int y) const;
+  // replaces the tiles of this level and every mip by blocks
+  void compress();
+  // memory held by this level and every mip
+  size_t bytes() const;
+};
+
+// what loading may spend on textures: the longest side they are decoded to
+// and the total size of all of them, 0 for no limit, and whether they are
+// stored compact
+struct TextureLimits {
+  int max_size = 0;
+  size_t budget = 0;
+  bool compact = false;
 };
 
 struct Face {
@@ -32,6 +98,13 @@ struct Material {
   std::string diffuse_map; // .mtl filename
 };
 
+// a run of consecutive faces, which in most files are close together, and
+// the centre of their bounding box
+struct Cluster {
+  int begin, end;
+  Vec3 centre;
+};
+
 class Model {
 private:
   std::vector<Vec3> verts{};
@@ -39,16 +112,29 @@ private:
   std::vector<Vec3> vert_normals{};
   std::vector<Vec2> vert_textures{};
   std::vector<Material> materials{};
+  std::vector<Cluster> clusters{};
+  std::vector<float> vert_ao{}; // per vertex, empty when not baked
+  std::vector<int> corners{};   // 3 per face, see corner()
+  int distinct_corners = 0;
+  std::vector<Vec3> face_normals{}; // per face, see face_normal()
   std::unordered_map<std::string, int> material_lookup;
   std::string directory;
+  TextureLimits texture_limits;
+
+  void fit_texture_budget();
 
 public:
-  Model(const std::string &filename);
+  Model(const std::string &filename, const TextureLimits &limits = {});
   void load_mtl(const std::string &filename);
   void load_texture(Material *mat);
+  void build_clusters();
+  void build_corners();
+  void build_face_normals();
   int nverts() const { return verts.size(); };
   int nfaces() const { return faces.size(); };
   Vec3 &vert(const int i) { return verts[i]; };
+  const Vec3 &vert(const int i) const { return verts[i]; };
+  const Face &face(const int i) const { return faces[i]; };
   Vec3 &vert(const int iface, const int nth_vert) {
     return verts[faces[iface].v[nth_vert]];
   };
@@ -72,6 +158,23 @@ public:
       return fb;
     return vert_textures[idx];
   }
+  const std::vector<Cluster> &face_clusters() const { return clusters; }
+  // a face corner's index among the model's distinct combinations of
+  // vertex, normal and material, which all light alike
+  int corner(const int iface, const int nth_vert) const {
+    return corners[3 * iface + nth_vert];
+  }
+  int ncorners() const { return distinct_corners; }
+  // unit normal of a face's plane, on the side its vertex normals face
+  const Vec3 &face_normal(const int iface) const {
+    return face_normals[iface];
+  }
+  void set_occlusion(std::vector<float> ao) { vert_ao = std::move(ao); }
+  bool occluded() const { return !vert_ao.empty(); }
+  // share of ambient light reaching a face's vertex, 1 when not baked
+  float occlusion(const int iface, const int nth_vert) const {
+    return vert_ao.empty() ? 1.0f : vert_ao[faces[iface].v[nth_vert]];
+  }
   const Material &mat(const int face_idx) const {
     static Material default_mat;
     int id = faces[face_idx].material_id;
@@ -79,4 +182,8 @@ public:
       return default_mat;
     return materials[id];
   }
-};
\ No newline at end of file
+};
+
+// reads an image file into rgb texels, false when it cannot be decoded.
+// halved with a box filter until its longest side is at most max_size
+bool load_image(const std::string &path, Texture &image, int max_size = 0);
\ No newline at end of file
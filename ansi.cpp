@@ -0,0 +1,375 @@
+#include "ansi.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+
+// a cell is its upper and lower colour, each packed as 0x00bbggrr or as
+// a palette index, the two side by side so four cells fill eight lanes
+static inline int32_t pack(Color c) { return c.r | c.g << 8 | c.b << 16; }
+
+// "n;" for every byte value, stored 4 bytes wide so it is copied with one
+// fixed-size move and the end advanced by len
+struct Decimal {
+  char text[4];
+  int len;
+};
+
+static constexpr std::array<Decimal, 256> make_decimals() {
+  std::array<Decimal, 256> table{};
+  for (int n = 0; n < 256; ++n) {
+    Decimal &d = table[n];
+    if (n >= 100)
+      d.text[d.len++] = '0' + n / 100;
+    if (n >= 10)
+      d.text[d.len++] = '0' + n / 10 % 10;
+    d.text[d.len++] = '0' + n % 10;
+    d.text[d.len++] = ';';
+  }
+  return table;
+}
+
+static constexpr std::array<Decimal, 256> DECIMALS = make_decimals();
+
+// the most a cell can take: a cursor move with two 5-digit coordinates,
+// both colours at full length and the glyph
+static const int MAX_CELL_BYTES = 14 + 2 * 19 + 3;
+
+static inline char *put(char *p, const char *s, int n) {
+  memcpy(p, s, n);
+  return p + n;
+}
+
+static ColorMode color_mode = COLORS_TRUE;
+static bool dither = false;
+static RunMode run_mode = RUNS_SPACES;
+
+// SGR colour, foreground or background, of a packed cell colour
+static inline char *put_colour(char *p, bool fg, int32_t c) {
+  if (color_mode == COLORS_16) {
+    // 30-37 and 40-47, then 90-97 and 100-107 for the bright half
+    p = put(p, "\033[", 2);
+    if (c >= 8)
+      p = put(p, fg ? "9" : "10", fg ? 1 : 2);
+    else
+      *p++ = fg ? '3' : '4';
+    *p++ = '0' + (c & 7);
+    *p++ = 'm';
+    return p;
+  }
+  if (color_mode == COLORS_256) {
+    p = put(p, fg ? "\033[38;5;" : "\033[48;5;", 7);
+    memcpy(p, DECIMALS[c].text, 4);
+    p += DECIMALS[c].len;
+  } else {
+    p = put(p, fg ? "\033[38;2;" : "\033[48;2;", 7);
+    for (int shift = 0; shift < 24; shift += 8) {
+      const Decimal &d = DECIMALS[c >> shift & 0xff];
+      memcpy(p, d.text, 4);
+      p += d.len;
+    }
+  }
+  p[-1] = 'm';
+  return p;
+}
+
+// colours of the 16 standard entries as xterm sets them, which most
+// terminals follow closely
+static const Color STANDARD_16[16] = {
+    {0, 0, 0},       {205, 0, 0},     {0, 205, 0},     {205, 205, 0},
+    {0, 0, 238},     {205, 0, 205},   {0, 205, 205},   {229, 229, 229},
+    {127, 127, 127}, {255, 0, 0},     {0, 255, 0},     {255, 255, 0},
+    {92, 92, 255},   {255, 0, 255},   {0, 255, 255},   {255, 255, 255}};
+
+// palette index by colour at 5 bits a channel, red lowest
+static const int LUT_BITS = 5, LUT_SIZE = 1 << LUT_BITS;
+static std::vector<unsigned char> palette_lut;
+// per palette entry, how far its nearest neighbour lies on the channel
+// they differ most in: the step dithering has to bridge there
+static unsigned char palette_step[256];
+
+// the palette entry nearest each cell of the table, by squared distance
+// weighted roughly as the eye weighs the channels
+static void build_palette_lut(ColorMode mode) {
+  std::vector<Color> palette;
+  if (mode == COLORS_16) {
+    palette.assign(STANDARD_16, STANDARD_16 + 16);
+  } else {
+    // 16-231 the 6x6x6 cube, 232-255 a grey ramp. the first 16 are left
+    // out: terminals theme them, so their colours are not known
+    static const unsigned char LEVELS[6] = {0, 95, 135, 175, 215, 255};
+    palette.resize(16, Color{0, 0, 0});
+    for (int i = 0; i < 216; ++i)
+      palette.push_back({LEVELS[i / 36], LEVELS[i / 6 % 6], LEVELS[i % 6]});
+    for (int i = 0; i < 24; ++i) {
+      unsigned char v = 8 + 10 * i;
+      palette.push_back({v, v, v});
+    }
+  }
+  int first = mode == COLORS_16 ? 0 : 16;
+  palette_lut.resize(LUT_SIZE * LUT_SIZE * LUT_SIZE);
+  for (int i = 0; i < (int)palette_lut.size(); ++i) {
+    int step = 256 / LUT_SIZE;
+    int r = (i % LUT_SIZE) * step + step / 2;
+    int g = (i / LUT_SIZE % LUT_SIZE) * step + step / 2;
+    int b = (i / (LUT_SIZE * LUT_SIZE)) * step + step / 2;
+    int best = first, best_distance = INT32_MAX;
+    for (int k = first; k < (int)palette.size(); ++k) {
+      int dr = r - palette[k].r, dg = g - palette[k].g, db = b - palette[k].b;
+      int distance = 3 * dr * dr + 4 * dg * dg + 2 * db * db;
+      if (distance < best_distance)
+        best = k, best_distance = distance;
+    }
+    palette_lut[i] = best;
+  }
+  for (int k = first; k < (int)palette.size(); ++k) {
+    int step = 255;
+    for (int j = first; j < (int)palette.size(); ++j) {
+      if (j == k)
+        continue;
+      int dr = std::abs(palette[j].r - palette[k].r);
+      int dg = std::abs(palette[j].g - palette[k].g);
+      int db = std::abs(palette[j].b - palette[k].b);
+      step = std::min(step, std::max({dr, dg, db}));
+    }
+    palette_step[k] = step;
+  }
+}
+
+ColorMode detect_color_mode() {
+  const char *colorterm = getenv("COLORTERM");
+  const char *term = getenv("TERM");
+  if (colorterm &&
+      (strstr(colorterm, "truecolor") || strstr(colorterm, "24bit")))
+    return COLORS_TRUE;
+  if (term && strstr(term, "direct"))
+    return COLORS_TRUE;
+  if (term && strstr(term, "256color"))
+    return COLORS_256;
+  return COLORS_16;
+}
+
+void set_color_mode(ColorMode mode, bool dithered) {
+  color_mode = mode;
+  dither = dithered && mode != COLORS_TRUE;
+  if (mode != COLORS_TRUE)
+    build_palette_lut(mode);
+  invalidate_screen();
+}
+
+static inline int lookup(int r, int g, int b) {
+  const int shift = 8 - LUT_BITS;
+  return palette_lut[(r >> shift) | (g >> shift) << LUT_BITS |
+                     (b >> shift) << 2 * LUT_BITS];
+}
+
+// 4x4 bayer thresholds
+static const int BAYER[4][4] = {
+    {0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+
+// the palette index of pixel (x, y) of colour c. dithering moves the colour
+// by up to half the step between palette entries where it lies, so the
+// grey ramp near black gets a fine pattern and the colour cube a coarse one
+static inline int32_t reduce(Color c, int x, int y) {
+  int index = lookup(c.r, c.g, c.b);
+  if (!dither)
+    return index;
+  int offset = (2 * BAYER[y & 3][x & 3] - 15) * palette_step[index] / 32;
+  return lookup(std::clamp(c.r + offset, 0, 255),
+                std::clamp(c.g + offset, 0, 255),
+                std::clamp(c.b + offset, 0, 255));
+}
+
+static inline int count_digits(int n) {
+  int len = 1;
+  while (n >= 10) {
+    n /= 10;
+    ++len;
+  }
+  return len;
+}
+
+static inline char *put_number(char *p, int n) {
+  char digits[10];
+  int len = 0;
+  do
+    digits[len++] = '0' + n % 10;
+  while (n /= 10);
+  while (len)
+    *p++ = digits[--len];
+  return p;
+}
+
+// what the terminal shows, as last encoded: the cells in screen order.
+// empty when unknown
+static std::vector<int32_t> shown;
+static int shown_cols = 0, shown_rows = 0;
+
+void invalidate_screen() { shown.clear(); }
+
+void set_run_mode(RunMode mode) {
+  run_mode = mode;
+  invalidate_screen();
+}
+
+// per cell: whether it differs from what is shown, and whether it is the
+// same as the cell left of it in the row, which then needs only its glyph
+enum { CELL_CHANGED = 1, CELL_REPEATS = 2 };
+
+// flags for cells [0, n), 4 at a time, against the cells shown before or
+// all changed when that is null. cells starts a cell early, at cells[2]
+static void flag_cells(const int32_t *cells, const int32_t *before, int n,
+                       unsigned char *flags) {
+  using namespace simd;
+  for (int i = 0; i < n; i += 4) {
+    const int32_t *c = cells + 2 + 2 * i;
+    i32x8 now = load(c);
+    int repeats = bits(equal(now, load(c - 2)));
+    int same = before ? bits(equal(now, load(before + 2 * i))) : 0;
+    for (int k = 0; k < 4 && i + k < n; ++k)
+      flags[i + k] = ((same >> 2 * k & 3) != 3 ? CELL_CHANGED : 0) |
+                     ((repeats >> 2 * k & 3) == 3 ? CELL_REPEATS : 0);
+  }
+}
+
+// writes the cells flagged changed to p, all of them when every cell is.
+// runs of repeating cells share one colour change and their glyphs are
+// copied as a block
+static char *encode_cells(const int32_t *cells, const unsigned char *flags,
+                          int cols, int rows, char *p) {
+  // glyphs for the longest run one copy handles
+  static const char GLYPHS[] = "▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀";
+  const int GLYPH_RUN = (sizeof GLYPHS - 1) / 3;
+
+  int32_t fg = -1, bg = -1; // unknown at the start of a frame
+  int cursor_x = 0, cursor_y = -1; // unknown
+  // past the last column the cursor waits there until the next glyph
+  // wraps it, so it can only be moved from there absolutely
+  bool wrapping = false;
+  for (int y = 0; y < rows; ++y) {
+    const int32_t *row = cells + 2 * y * cols;
+    const unsigned char *row_flags = flags + y * cols;
+    for (int x = 0; x < cols;) {
+      if (!(row_flags[x] & CELL_CHANGED)) {
+        ++x;
+        continue;
+      }
+      // a cell of one colour is a space on that background, whatever the
+      // foreground
+      bool solid = run_mode != RUNS_GLYPHS && row[2 * x] == row[2 * x + 1];
+      int end = x + 1;
+      while (end < cols && row_flags[end] == (CELL_CHANGED | CELL_REPEATS))
+        ++end;
+      int n = end - x, glyph_bytes = solid ? 1 : 3;
+      bool erase =
+          solid && run_mode == RUNS_ERASE && n > 6 + 2 * count_digits(n);
+      // a glyph printed at a pending wrap lands at the start of the next
+      // row, but an erase would act where the cursor waits, so it needs
+      // the cursor placed there first
+      if (cursor_y != y || (wrapping && (cursor_x != x || erase))) {
+        p = put(p, "\033[", 2);
+        p = put_number(p, y + 1);
+        *p++ = ';';
+        p = put_number(p, x + 1);
+        *p++ = 'H';
+      } else if (cursor_x != x) {
+        p = put(p, "\033[", 2);
+        p = put_number(p, x - cursor_x);
+        *p++ = 'C';
+      }
+      if (row[2 * x] != fg && !solid)
+        p = put_colour(p, true, fg = row[2 * x]);
+      if (row[2 * x + 1] != bg)
+        p = put_colour(p, false, bg = row[2 * x + 1]);
+      if (erase) {
+        // erasing paints the background but leaves the cursor where it
+        // is: the next cell drawn moves it on
+        p = put(p, "\033[", 2);
+        p = put_number(p, n);
+        *p++ = 'X';
+        x = end;
+        wrapping = false;
+        cursor_x = x - n;
+        cursor_y = y;
+        continue;
+      }
+      if (run_mode == RUNS_REPEAT &&
+          (n - 1) * glyph_bytes > 3 + count_digits(n - 1)) {
+        p = solid ? put(p, " ", 1) : put(p, GLYPHS, 3);
+        p = put(p, "\033[", 2);
+        p = put_number(p, n - 1);
+        *p++ = 'b';
+      } else if (solid) {
+        memset(p, ' ', n);
+        p += n;
+      } else {
+        for (int left = n; left > 0; left -= GLYPH_RUN)
+          p = put(p, GLYPHS, 3 * std::min(left, GLYPH_RUN));
+      }
+      x = end;
+      wrapping = x == cols;
+      cursor_x = wrapping ? 0 : x;
+      cursor_y = wrapping ? y + 1 : y;
+    }
+  }
+  return p;
+}
+
+std::string_view encode_frame(const std::vector<Color> &image, int cols,
+                              int rows) {
+  // the image's rows paired into cells in screen order, padded with a
+  // cell before and three after for the loads of flag_cells
+  static std::vector<int32_t> cells;
+  static std::vector<unsigned char> flags;
+  // changes only, then all cells in case that is shorter
+  static std::vector<char> changes, all;
+  size_t n = size_t(cols) * rows;
+  cells.resize(2 * n + 8);
+  flags.resize(n);
+  int height = 2 * rows;
+  for (int y = 0; y < rows; ++y) {
+    const Color *top = &image[size_t(height - 1 - 2 * y) * cols];
+    const Color *bottom = top - cols;
+    int32_t *cell = &cells[2 + 2 * size_t(y) * cols];
+    if (color_mode == COLORS_TRUE)
+      for (int x = 0; x < cols; ++x)
+        cell[2 * x] = pack(top[x]), cell[2 * x + 1] = pack(bottom[x]);
+    else
+      for (int x = 0; x < cols; ++x) {
+        cell[2 * x] = reduce(top[x], x, 2 * y);
+        cell[2 * x + 1] = reduce(bottom[x], x, 2 * y + 1);
+      }
+  }
+  size_t worst = n * MAX_CELL_BYTES;
+  if (changes.size() < worst)
+    changes.resize(worst), all.resize(worst);
+
+  bool known = shown.size() == 2 * n + 8 && shown_cols == cols &&
+               shown_rows == rows;
+  flag_cells(cells.data(), known ? shown.data() + 2 : nullptr, n,
+             flags.data());
+  for (int y = 1; y < rows; ++y)
+    flags[size_t(y) * cols] &= ~CELL_REPEATS;
+
+  std::string_view out;
+  if (known) {
+    char *end = encode_cells(cells.data() + 2, flags.data(), cols, rows,
+                             changes.data());
+    out = {changes.data(), size_t(end - changes.data())};
+  }
+  // a full frame takes at least a glyph per cell. past that, changes
+  // scattered over most of the screen can cost more than all of it
+  if (!known || out.size() > 3 * n) {
+    for (size_t i = 0; i < n; ++i)
+      flags[i] |= CELL_CHANGED;
+    char *end = encode_cells(cells.data() + 2, flags.data(), cols, rows,
+                             all.data());
+    if (!known || size_t(end - all.data()) < out.size())
+      out = {all.data(), size_t(end - all.data())};
+  }
+  shown.swap(cells);
+  shown_cols = cols;
+  shown_rows = rows;
+  return out;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "Model.hpp"
+#include <string_view>
+#include <vector>
+
+// the escape sequences that bring the terminal to image, a
+// cell per 2 pixels: '▀' in the upper one's colour over the lower one's.
+// image is cols x (2 * rows) with its bottom row first. only the cells
+// that differ from the last frame are drawn, unless that would take more
+// bytes than drawing them all. the result stays valid until the next call
+std::string_view encode_frame(const std::vector<Color> &image, int cols,
+                              int rows);
+// the terminal was cleared or lost what it showed: the next frame is drawn
+// in full
+void invalidate_screen();
+
+// escapes used for colours: 24-bit, or the 256-colour or 16-colour palette
+// that frames are then reduced to
+enum ColorMode { COLORS_TRUE, COLORS_256, COLORS_16 };
+
+// the most the terminal advertises through COLORTERM and TERM
+ColorMode detect_color_mode();
+// with dithered, the reduced palettes spread their error over a 4x4
+// ordered pattern
+void set_color_mode(ColorMode mode, bool dithered);
+
+// how runs of equal cells are drawn: a glyph each, with one-colour cells as
+// spaces, as those with long one-colour runs erased (ECH) instead, or as one
+// cell the terminal repeats (REP). erasing relies on the terminal filling
+// with the background colour and not every terminal repeats, so both are
+// left to be asked for
+enum RunMode { RUNS_GLYPHS, RUNS_SPACES, RUNS_ERASE, RUNS_REPEAT };
+
+void set_run_mode(RunMode mode);
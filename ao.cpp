@@ -0,0 +1,310 @@
+#include "ao.hpp"
+#include "pool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// rays that get this far, in the normalised model's units, count as open:
+// occlusion stays local to creases and cavities
+static const float AO_RADIUS = 0.5f;
+// rays start this far off the surface so they miss the faces they leave
+static const float AO_BIAS = 1e-4f;
+// faces per leaf, and vertices per job handed to the pool
+static const int LEAF_SIZE = 4, VERTS_PER_JOB = 256;
+
+struct Ray {
+  Vec3 origin, dir, inv_dir;
+  float far;
+};
+
+// a face ready for intersection: a corner and its two edges
+struct Edges {
+  Vec3 a, e1, e2;
+};
+
+// bounding volume hierarchy over the faces. an inner node's left child
+// follows it; leaves hold count faces from first
+struct Node {
+  float lo[3], hi[3];
+  int first, count, right;
+};
+
+class Bvh {
+private:
+  std::vector<Node> nodes;
+  std::vector<Edges> tris;
+
+  int build(std::vector<int> &order, std::vector<Vec3> &centre, int first,
+            int count, const std::vector<Edges> &all);
+  static bool hits_box(const Node &node, const Ray &ray);
+  static bool hits_face(const Edges &t, const Ray &ray);
+
+public:
+  Bvh(const std::vector<Edges> &faces);
+  // whether anything lies along the ray before ray.far
+  bool occluded(const Ray &ray) const;
+};
+
+Bvh::Bvh(const std::vector<Edges> &faces) {
+  std::vector<int> order(faces.size());
+  std::vector<Vec3> centre(faces.size());
+  for (size_t i = 0; i < faces.size(); ++i) {
+    order[i] = i;
+    Edges t = faces[i];
+    centre[i] = t.a + (t.e1 + t.e2) * (1 / 3.0f);
+  }
+  nodes.reserve(2 * faces.size() / LEAF_SIZE + 1);
+  tris.reserve(faces.size());
+  if (!faces.empty())
+    build(order, centre, 0, faces.size(), faces);
+}
+
+// splits at the median centroid along the axis the centroids spread most
+int Bvh::build(std::vector<int> &order, std::vector<Vec3> &centre, int first,
+               int count, const std::vector<Edges> &all) {
+  int index = nodes.size();
+  nodes.push_back({});
+  Node node = {{INFINITY, INFINITY, INFINITY},
+               {-INFINITY, -INFINITY, -INFINITY}, 0, 0, 0};
+  float clo[3] = {INFINITY, INFINITY, INFINITY};
+  float chi[3] = {-INFINITY, -INFINITY, -INFINITY};
+  for (int i = first; i < first + count; ++i) {
+    Edges t = all[order[i]];
+    Vec3 corners[3] = {t.a, t.a + t.e1, t.a + t.e2};
+    for (const Vec3 &p : corners)
+      for (int k = 0; k < 3; ++k) {
+        node.lo[k] = std::min(node.lo[k], p.data[k]);
+        node.hi[k] = std::max(node.hi[k], p.data[k]);
+      }
+    for (int k = 0; k < 3; ++k) {
+      clo[k] = std::min(clo[k], centre[order[i]].data[k]);
+      chi[k] = std::max(chi[k], centre[order[i]].data[k]);
+    }
+  }
+
+  if (count <= LEAF_SIZE) {
+    node.first = tris.size();
+    node.count = count;
+    for (int i = first; i < first + count; ++i)
+      tris.push_back(all[order[i]]);
+    nodes[index] = node;
+    return index;
+  }
+
+  int axis = 0;
+  for (int k = 1; k < 3; ++k)
+    if (chi[k] - clo[k] > chi[axis] - clo[axis])
+      axis = k;
+  int half = count / 2;
+  std::nth_element(order.begin() + first, order.begin() + first + half,
+                   order.begin() + first + count, [&](int a, int b) {
+                     return centre[a].data[axis] < centre[b].data[axis];
+                   });
+  build(order, centre, first, half, all);
+  node.right = build(order, centre, first + half, count - half, all);
+  nodes[index] = node;
+  return index;
+}
+
+bool Bvh::hits_box(const Node &node, const Ray &ray) {
+  float t0 = 0, t1 = ray.far;
+  for (int k = 0; k < 3; ++k) {
+    float a = (node.lo[k] - ray.origin.data[k]) * ray.inv_dir.data[k];
+    float b = (node.hi[k] - ray.origin.data[k]) * ray.inv_dir.data[k];
+    t0 = std::max(t0, std::min(a, b));
+    t1 = std::min(t1, std::max(a, b));
+  }
+  return t0 <= t1;
+}
+
+// moller-trumbore, either side of the face
+bool Bvh::hits_face(const Edges &tri, const Ray &ray) {
+  Edges t = tri;
+  Vec3 dir = ray.dir;
+  Vec3 p = dir.cross(t.e2);
+  float det = t.e1 * p;
+  if (std::abs(det) < 1e-12f)
+    return false;
+  float inv_det = 1 / det;
+  Vec3 origin = ray.origin;
+  Vec3 s = origin - t.a;
+  float u = (s * p) * inv_det;
+  if (u < 0 || u > 1)
+    return false;
+  Vec3 q = s.cross(t.e1);
+  float v = (dir * q) * inv_det;
+  if (v < 0 || u + v > 1)
+    return false;
+  float dist = (t.e2 * q) * inv_det;
+  return dist > 0 && dist < ray.far;
+}
+
+bool Bvh::occluded(const Ray &ray) const {
+  if (nodes.empty())
+    return false;
+  int stack[64], depth = 0;
+  stack[depth++] = 0;
+  while (depth) {
+    const Node &node = nodes[stack[--depth]];
+    if (!hits_box(node, ray))
+      continue;
+    if (node.count) {
+      for (int i = node.first; i < node.first + node.count; ++i)
+        if (hits_face(tris[i], ray))
+          return true;
+    } else {
+      stack[depth++] = node.right;
+      stack[depth++] = &node - nodes.data() + 1;
+    }
+  }
+  return false;
+}
+
+// i-th of n points of the hammersley set, mapped to the cosine-weighted
+// hemisphere around +z after its angle is turned by spin (in turns)
+static Vec3 hemisphere(int i, int n, float spin) {
+  uint32_t bits = i;
+  bits = (bits << 16) | (bits >> 16);
+  bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+  bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+  bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+  bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+  float u = (i + 0.5f) / n, turn = bits * 2.3283064e-10f + spin;
+  float r = std::sqrt(u), phi = 2 * float(M_PI) * turn;
+  return {r * std::cos(phi), r * std::sin(phi), std::sqrt(1 - u)};
+}
+
+// cache file: a header naming the mesh and ray count, then one float per
+// vertex
+struct CacheHeader {
+  char magic[8];
+  uint32_t rays, verts, faces;
+  uint32_t pad; // named so it is zeroed: headers are compared by memcmp
+  uint64_t mesh_hash;
+};
+
+static const char CACHE_MAGIC[8] = "objvao1";
+
+// fnv-1a over vertex positions and face indices, so an edited model
+// invalidates its cache
+static uint64_t mesh_hash(const Model &model) {
+  uint64_t h = 14695981039346656037ull;
+  auto mix = [&](const void *p, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+      h = (h ^ static_cast<const unsigned char *>(p)[i]) * 1099511628211ull;
+  };
+  for (int i = 0; i < model.nverts(); ++i)
+    mix(&model.vert(i), sizeof(Vec3));
+  for (int i = 0; i < model.nfaces(); ++i)
+    mix(model.face(i).v.data(), sizeof(int) * 3);
+  return h;
+}
+
+static bool read_cache(const std::string &path, const CacheHeader &expect,
+                       std::vector<float> &ao) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+    return false;
+  CacheHeader header;
+  bool ok = fread(&header, sizeof header, 1, f) == 1 &&
+            !memcmp(&header, &expect, sizeof header);
+  if (ok) {
+    ao.resize(expect.verts);
+    ok = fread(ao.data(), sizeof(float), ao.size(), f) == ao.size();
+  }
+  fclose(f);
+  return ok;
+}
+
+static void write_cache(const std::string &path, const CacheHeader &header,
+                        const std::vector<float> &ao) {
+  // a read-only model directory just means baking again next time
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f)
+    return;
+  bool ok = fwrite(&header, sizeof header, 1, f) == 1 &&
+            fwrite(ao.data(), sizeof(float), ao.size(), f) == ao.size();
+  if (fclose(f) || !ok)
+    remove(path.c_str());
+}
+
+void bake_occlusion(Model &model, int rays, int threads,
+                    const std::string &cache_path) {
+  CacheHeader header = {};
+  memcpy(header.magic, CACHE_MAGIC, sizeof header.magic);
+  header.rays = rays;
+  header.verts = model.nverts();
+  header.faces = model.nfaces();
+  header.mesh_hash = mesh_hash(model);
+  std::vector<float> ao;
+  if (read_cache(cache_path, header, ao)) {
+    model.set_occlusion(std::move(ao));
+    return;
+  }
+
+  // vertices at the same position, as along uv seams and at poles, share
+  // one normal so none of them leans towards the faces on its side
+  std::vector<int> same(model.nverts());
+  std::unordered_map<std::string, int> first;
+  for (int v = 0; v < model.nverts(); ++v) {
+    std::string key(reinterpret_cast<const char *>(&model.vert(v)),
+                    sizeof(Vec3));
+    same[v] = first.emplace(key, v).first->second;
+  }
+
+  // normals from the geometry itself: the model's face normals, each
+  // weighted by its face's area
+  std::vector<Edges> faces(model.nfaces());
+  std::vector<Vec3> normal(model.nverts(), Vec3{0, 0, 0});
+  for (int i = 0; i < model.nfaces(); ++i) {
+    Vec3 a = model.vert(i, 0), b = model.vert(i, 1), c = model.vert(i, 2);
+    faces[i] = {a, b - a, c - a};
+    float area = (b - a).cross(c - a).mag();
+    if (area == 0)
+      continue; // no normal to weight
+    Vec3 n = model.face_normal(i);
+    for (int v : model.face(i).v)
+      normal[same[v]] = normal[same[v]] + n * area;
+  }
+  Bvh bvh(faces);
+
+  ao.assign(model.nverts(), 1.0f);
+  auto bake = [&](int job) {
+    int end = std::min(model.nverts(), (job + 1) * VERTS_PER_JOB);
+    for (int v = job * VERTS_PER_JOB; v < end; ++v) {
+      Vec3 n = normal[same[v]];
+      if (n * n == 0)
+        continue;
+      n = n.n();
+      // an orthonormal frame around the normal (duff et al. 2017)
+      float sign = std::copysign(1.0f, n.z);
+      float a = -1 / (sign + n.z), b = n.x * n.y * a;
+      Vec3 t = {1 + sign * n.x * n.x * a, sign * b, -sign * n.x};
+      Vec3 s = {b, sign + n.y * n.y * a, -n.y};
+      // every vertex turns the pattern differently, so neighbours'
+      // sampling errors do not line up into bands
+      float spin = (v * 0.6180340f) - std::floor(v * 0.6180340f);
+      int open = 0;
+      for (int i = 0; i < rays; ++i) {
+        Vec3 h = hemisphere(i, rays, spin);
+        Ray ray;
+        ray.dir = t * h.x + s * h.y + n * h.z;
+        ray.origin = model.vert(v) + n * AO_BIAS;
+        ray.inv_dir = {1 / ray.dir.x, 1 / ray.dir.y, 1 / ray.dir.z};
+        ray.far = AO_RADIUS;
+        open += !bvh.occluded(ray);
+      }
+      ao[v] = float(open) / rays;
+    }
+  };
+  int jobs = (model.nverts() + VERTS_PER_JOB - 1) / VERTS_PER_JOB;
+  ThreadPool pool(threads);
+  pool.run(jobs, bake);
+
+  write_cache(cache_path, header, ao);
+  model.set_occlusion(std::move(ao));
+}
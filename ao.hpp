@@ -0,0 +1,10 @@
+#pragma once
+#include "Model.hpp"
+#include <string>
+
+// per-vertex ambient occlusion: the share of rays cast over each vertex's
+// hemisphere that leave the mesh without hitting it nearby. taken from
+// cache_path when that holds values for this mesh and ray count, otherwise
+// baked on threads threads and written there for next time
+void bake_occlusion(Model &model, int rays, int threads,
+                    const std::string &cache_path);
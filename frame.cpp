@@ -0,0 +1,73 @@
+#include "frame.hpp"
+#include <algorithm>
+#include <cstdint>
+
+static_assert(sizeof(Color) == 3, "frames are walked as packed bytes");
+
+void downsample(const std::vector<Color> &src, int width, int height,
+                int factor, std::vector<Color> &dst) {
+  int out_width = width / factor, out_height = height / factor;
+  dst.resize(size_t(out_width) * out_height);
+  // 16-bit fixed-point reciprocal of the block size, rounded, so averaging
+  // is a multiply and a shift
+  const uint32_t scale = ((1 << 16) + factor * factor / 2) / (factor * factor);
+  static std::vector<uint16_t> sums;
+  sums.resize(size_t(width) * 3);
+
+  for (int y = 0; y < out_height; ++y) {
+    // sum the block rows byte by byte first: plain loops over whole rows
+    // that compilers turn into wide integer adds
+    std::fill(sums.begin(), sums.end(), 0);
+    for (int k = 0; k < factor; ++k) {
+      const unsigned char *row = &src[size_t(y * factor + k) * width].r;
+      for (int i = 0; i < width * 3; ++i)
+        sums[i] += row[i];
+    }
+    unsigned char *out = &dst[size_t(y) * out_width].r;
+    for (int x = 0; x < out_width; ++x)
+      for (int c = 0; c < 3; ++c) {
+        uint32_t sum = 0;
+        for (int k = 0; k < factor; ++k)
+          sum += sums[(x * factor + k) * 3 + c];
+        out[x * 3 + c] = (sum * scale + (1 << 15)) >> 16;
+      }
+  }
+}
+
+// for each output coordinate, the source pixel at or before it and the
+// 8-bit weight of the one after, mapping pixel centres onto pixel centres
+static void bilinear_taps(int size, int out_size, std::vector<int> &index,
+                          std::vector<int> &weight) {
+  index.resize(out_size);
+  weight.resize(out_size);
+  for (int i = 0; i < out_size; ++i) {
+    float s = std::max(0.0f, (i + 0.5f) * size / out_size - 0.5f);
+    int base = std::min(static_cast<int>(s), size - 1);
+    index[i] = base;
+    weight[i] = base + 1 < size ? static_cast<int>((s - base) * 256 + 0.5f) : 0;
+  }
+}
+
+void upsample(const std::vector<Color> &src, int width, int height,
+              std::vector<Color> &dst, int out_width, int out_height) {
+  static std::vector<int> x_index, x_weight, y_index, y_weight;
+  bilinear_taps(width, out_width, x_index, x_weight);
+  bilinear_taps(height, out_height, y_index, y_weight);
+  dst.resize(size_t(out_width) * out_height);
+
+  for (int y = 0; y < out_height; ++y) {
+    int y0 = y_index[y], y1 = std::min(y0 + 1, height - 1), wy = y_weight[y];
+    const unsigned char *row0 = &src[size_t(y0) * width].r;
+    const unsigned char *row1 = &src[size_t(y1) * width].r;
+    unsigned char *out = &dst[size_t(y) * out_width].r;
+    for (int x = 0; x < out_width; ++x) {
+      int a = x_index[x] * 3, b = std::min(x_index[x] + 1, width - 1) * 3;
+      int wx = x_weight[x];
+      for (int c = 0; c < 3; ++c) {
+        int top = row0[a + c] * 256 + (row0[b + c] - row0[a + c]) * wx;
+        int bottom = row1[a + c] * 256 + (row1[b + c] - row1[a + c]) * wx;
+        out[x * 3 + c] = (top * 256 + (bottom - top) * wy + (1 << 15)) >> 16;
+      }
+    }
+  }
+}
\ No newline at end of file
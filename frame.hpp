@@ -0,0 +1,11 @@
+#pragma once
+#include "Model.hpp"
+#include <vector>
+
+// averages every factor x factor block of the width x height src into one
+// pixel of dst, which is resized to (width / factor) x (height / factor)
+void downsample(const std::vector<Color> &src, int width, int height,
+                int factor, std::vector<Color> &dst);
+// bilinearly scales the width x height src to out_width x out_height
+void upsample(const std::vector<Color> &src, int width, int height,
+              std::vector<Color> &dst, int out_width, int out_height);
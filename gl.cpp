@@ -1,13 +1,26 @@
 #include "gl.hpp"
 #include "Model.hpp"
+#include "pool.hpp"
+#include "simd.hpp"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 static Mat4 M = IDENTITY_MAT4, V = IDENTITY_MAT4, P = IDENTITY_MAT4,
             PVM = IDENTITY_MAT4;
 
-static inline void recalculate_mvp() { PVM = P * V * M; }
+// bumped whenever the transforms change, which is when lit corners go stale
+static uint32_t transform_stamp = 1;
+
+static inline void recalculate_mvp() {
+  PVM = P * V * M;
+  transform_stamp = (transform_stamp + 1) & 0x7fffffff;
+}
 
 void set_model(Vec3 pos, Vec3 rot, Vec3 scale) {
   float theta = rot.x;
@@ -64,10 +77,31 @@ void set_perspective(float near, float far, float aspect_ratio, float fov) {
   recalculate_mvp();
 }
 
-static float signed_triangle_area(Vec2 a, Vec2 b, Vec2 c) {
+// screen positions are snapped to 1/256 of a pixel and coverage is decided
+// on those integers alone, so it is exact whatever the float rounding
+static const int SUBPIXEL_BITS = 8, SUBPIXEL = 1 << SUBPIXEL_BITS;
+// farther out, in pixels, the edge functions could overflow. only vertices
+// right at the camera plane project that far
+static const float GUARD_BAND = 1 << 22;
+
+struct Point {
+  int64_t x, y;
+};
+
+// triangles up to a pixel in area take one texel for the whole face instead
+// of sampling per pixel; in the doubled squared sub-pixel units of the edge
+// functions
+static const int64_t FACE_TEXEL_AREA = 2 * SUBPIXEL * SUBPIXEL;
+
+static int64_t signed_triangle_area(Point a, Point b, Point c) {
   return (b.x - a.x) * (c.y - b.y) - (c.x - b.x) * (b.y - a.y);
 }
 
+// rounds towards negative infinity, for b > 0
+static inline int64_t floor_div(int64_t a, int64_t b) {
+  return a / b - (a % b < 0);
+}
+
 Vec4 clip(const Vec3 &vertex) {
   Vec4 v_extended = Vec4{vertex.x, vertex.y, vertex.z, 1};
   Vec4 clip_vec4 = PVM * v_extended;
@@ -77,123 +111,1223 @@ Vec4 clip(const Vec3 &vertex) {
 }
 
 static std::vector<float> z_buffer;
+static int z_width = 0, z_height = 0;
 
-void reset_z_buffer(size_t size) {
-  if (z_buffer.size() != size)
-    z_buffer.resize(size);
+// coarse depth: the farthest depth stored in each 8x8 block of z_buffer.
+// with a less-or-equal test only the farthest value can prove a triangle
+// hidden, so that is all this level keeps
+static const int HIZ_BLOCK = 8;
+static_assert(HIZ_BLOCK == 8, "blocks are refreshed one f32x8 row at a time");
+static std::vector<float> hiz;
+static int hiz_width = 0;
+
+void reset_z_buffer(int width, int height) {
+  z_width = width;
+  z_height = height;
+  hiz_width = (width + HIZ_BLOCK - 1) / HIZ_BLOCK;
+  size_t blocks = hiz_width * ((height + HIZ_BLOCK - 1) / HIZ_BLOCK);
+  if (z_buffer.size() != size_t(width) * height)
+    z_buffer.resize(size_t(width) * height);
+  if (hiz.size() != blocks)
+    hiz.resize(blocks);
 
   std::fill(z_buffer.begin(), z_buffer.end(), 1.0f);
+  std::fill(hiz.begin(), hiz.end(), 1.0f);
+}
+
+// refresh a block's farthest depth after pixels in it were written
+static void update_hiz(int bx, int by) {
+  using namespace simd;
+  int x0 = bx * HIZ_BLOCK, x1 = std::min(z_width, x0 + HIZ_BLOCK);
+  int y0 = by * HIZ_BLOCK, y1 = std::min(z_height, y0 + HIZ_BLOCK);
+  float farthest = -1;
+  if (x1 - x0 == 8) {
+    f32x8 rows = splat(-1);
+    for (int y = y0; y < y1; ++y)
+      rows = max(rows, load(&z_buffer[y * z_width + x0]));
+    alignas(32) float lanes[8];
+    store(lanes, rows);
+    for (float z : lanes)
+      farthest = std::max(farthest, z);
+  } else {
+    for (int y = y0; y < y1; ++y)
+      for (int x = x0; x < x1; ++x)
+        farthest = std::max(farthest, z_buffer[y * z_width + x]);
+  }
+  hiz[by * hiz_width + bx] = farthest;
+}
+
+// false when every block overlapping the rectangle is already nearer than
+// depth zmin, which hides a whole triangle
+static bool hiz_visible(float zmin, int x0, int y0, int x1, int y1) {
+  for (int by = y0 / HIZ_BLOCK; by <= y1 / HIZ_BLOCK; ++by)
+    for (int bx = x0 / HIZ_BLOCK; bx <= x1 / HIZ_BLOCK; ++bx)
+      if (zmin <= hiz[by * hiz_width + bx])
+        return true;
+  return false;
+}
+
+// whether the triangle's depth plane over the part of block (bx, by) inside
+// the rectangle is behind everything stored in that block. the plane is
+// linear, so its nearest point over the rectangle is one of the corners
+static bool hiz_hidden(const Triangle &tri, int bx, int by, int x0, int y0,
+                       int x1, int y1) {
+  x0 = std::max(x0, bx * HIZ_BLOCK);
+  x1 = std::min(x1, bx * HIZ_BLOCK + HIZ_BLOCK - 1);
+  y0 = std::max(y0, by * HIZ_BLOCK);
+  y1 = std::min(y1, by * HIZ_BLOCK + HIZ_BLOCK - 1);
+  float dx = tri.attr_dx[ATTR_Z], dy = tri.attr_dy[ATTR_Z];
+  float nearest = tri.attr_c[ATTR_Z] + dx * (x0 - tri.x0) +
+                  dy * (y0 - tri.y0) + std::min(0.0f, dx * (x1 - x0)) +
+                  std::min(0.0f, dy * (y1 - y0));
+  // stepping the plane per pixel rounds differently, so leave some slack
+  nearest = std::max(nearest - 1e-6f, tri.zmin);
+  return nearest > hiz[by * hiz_width + bx];
 }
 
 static Vec3 light_dir = Vec3{0, 1, 0.75}.n();
-static Vec3 camera_pos = {0, 0, 0};
 static float brightness = 1.0f;
 
 void set_brightness(float intensity) { brightness = intensity; }
 
-void rasterize(const Model &model, int face_idx, Vec4 v[3], Vec3 vn[3],
-               Vec2 uv[3], std::vector<Color> &frame, int width, float hw,
-               int height, float hh, const Color *override_color) {
-  const Material &mat = model.mat(face_idx);
-  for (const int &i : {0, 1, 2})
-    vn[i] = (M * Vec4{vn[i].x, vn[i].y, vn[i].z, 0}).xyz().n();
+static Shading shading = SHADING_PHONG;
+
+void set_shading(Shading mode) { shading = mode; }
+
+// the same lighting as the per-pixel path for one point: the factor applied
+// to each channel of the base colour. ao scales the ambient term
+static Vec3 light_point(const Material &mat, Vec3 n, Vec3 pos, float ao) {
+  Vec3 l = light_dir;
+  float n_dot_l = n * l;
+  float diff = std::max(n_dot_l, 0.0f);
+  // camera sits at the origin, so the view vector is -position
+  Vec3 view = (pos * -1).n();
+  Vec3 r = (n * (2 * n_dot_l) - l).n();
+  float spec = std::pow(std::max(r * view, 0.0f), mat.Ns);
+  Vec3 lit;
+  for (const int &c : {0, 1, 2})
+    lit.data[c] = std::min(
+        mat.ka.data[c] * ao + mat.kd.data[c] * diff + mat.ks.data[c] * spec,
+        1.0f);
+  return lit;
+}
+
+// gouraud colours of the distinct corners of the model last drawn, lit by
+// the first triangle that needs them after the transforms change. stamps
+// hold the transform_stamp a colour was lit under; a corner being written
+// is marked busy, and anyone else wanting it meanwhile lights their own
+static const uint32_t CORNER_BUSY = 0x80000000u;
+static const Model *corner_model = nullptr;
+static std::vector<Vec3> corner_lit;
+static std::unique_ptr<std::atomic<uint32_t>[]> corner_stamp;
+
+static void prepare_corners(const Model &m) {
+  if (corner_model == &m && corner_lit.size() == size_t(m.ncorners()))
+    return;
+  corner_model = &m;
+  corner_lit.resize(m.ncorners());
+  corner_stamp.reset(new std::atomic<uint32_t>[m.ncorners()]);
+  for (int i = 0; i < m.ncorners(); ++i)
+    corner_stamp[i].store(0, std::memory_order_relaxed);
+}
+
+static inline Vec3 view_normal(Vec3 n) {
+  return (M * Vec4{n.x, n.y, n.z, 0}).xyz().n();
+}
+
+// the lit colour of a face's corner with model-space normal n at clip-space
+// position pos
+static Vec3 light_corner(const Model &m, int face, int nth, Vec3 n, Vec3 pos) {
+  const Material &mat = m.mat(face);
+  float ao = m.occlusion(face, nth);
+  if (corner_model != &m)
+    return light_point(mat, view_normal(n), pos, ao);
+  std::atomic<uint32_t> &stamp = corner_stamp[m.corner(face, nth)];
+  Vec3 &cached = corner_lit[m.corner(face, nth)];
+  uint32_t seen = stamp.load(std::memory_order_acquire);
+  if (seen == transform_stamp)
+    return cached;
+  Vec3 lit = light_point(mat, view_normal(n), pos, ao);
+  if (seen != (transform_stamp | CORNER_BUSY) &&
+      stamp.compare_exchange_strong(seen, transform_stamp | CORNER_BUSY,
+                                    std::memory_order_acquire)) {
+    cached = lit;
+    stamp.store(transform_stamp, std::memory_order_release);
+  }
+  return lit;
+}
+
+// matcap colours by the view-space normal's x and y, one plane per channel
+// so lanes gather straight from it. empty when the mode is off
+static const int MATCAP_SIZE = 128;
+static std::vector<float> matcap[3];
+
+void set_matcap(const Texture *image) {
+  const float half = MATCAP_SIZE / 2, radius = half - 0.5f;
+  const Material clay{};
+  for (const int &c : {0, 1, 2})
+    matcap[c].resize(MATCAP_SIZE * MATCAP_SIZE);
+  for (int j = 0; j < MATCAP_SIZE; ++j)
+    for (int i = 0; i < MATCAP_SIZE; ++i) {
+      // the normal at the cell centre, cells past the rim take the rim's
+      float x = (i + 0.5f - half) / radius, y = (j + 0.5f - half) / radius;
+      float len = std::sqrt(x * x + y * y);
+      if (len > 1)
+        x /= len, y /= len;
+      Vec3 colour;
+      if (image) {
+        int tx = std::clamp(int((x + 1) * 0.5f * image->width), 0,
+                            image->width - 1);
+        int ty = std::clamp(int((1 - y) * 0.5f * image->height), 0,
+                            image->height - 1);
+        Color t = image->at(tx, ty);
+        colour = {float(t.r), float(t.g), float(t.b)};
+      } else {
+        Vec3 n = {x, y, std::sqrt(std::max(1 - x * x - y * y, 0.0f))};
+        colour = light_point(clay, n, {0, 0, -1}, 1) * 255;
+      }
+      for (const int &c : {0, 1, 2})
+        matcap[c][j * MATCAP_SIZE + i] = colour.data[c];
+    }
+}
+
+// the shading in effect: a matcap looks up the normal at every pixel
+static Shading lighting() {
+  return matcap[0].empty() ? shading : SHADING_PHONG;
+}
+
+// planes first to first + count - 1 at pixels dx, dy from the triangle's
+// origin. every pass evaluates them this one way rather than stepping them
+// from where it starts, so a pixel comes out the same whatever tile, thread
+// or pass draws it. kept out of line: each inlined copy could be
+// reassociated differently under -ffast-math
+__attribute__((noinline)) static void
+interpolate(const Triangle &tri, simd::f32x8 dx, simd::f32x8 dy, int first,
+            int count, simd::f32x8 *at) {
+  using namespace simd;
+  for (int k = first; k < first + count; ++k)
+    at[k - first] = splat(tri.attr_c[k]) + dy * splat(tri.attr_dy[k]) +
+                    dx * splat(tri.attr_dx[k]);
+}
+
+// depth at each sample of a triangle within 2x2 pixels, numbered as in
+// coverage
+static void sample_depths(const Triangle &tri, float depth[8]) {
+  using namespace simd;
+  alignas(32) static const float SX[8] = {0, 1, 0, 1}, SY[8] = {0, 0, 1, 1};
+  f32x8 z;
+  interpolate(tri, load(SX), load(SY), ATTR_Z, 1, &z);
+  store(depth, z);
+}
+
+__attribute__((noinline)) bool
+setup_triangle(const Model &model, int face_idx, Vec4 v[3], Vec3 vn[3],
+               Vec2 uv[3], int width, float hw, int height, float hh,
+               Triangle &tri) {
   float inv_w[3] = {1.0f / v[0].w, 1.0f / v[1].w, 1.0f / v[2].w};
   Vec3 a = v[0].xyz() * inv_w[0];
   Vec3 b = v[1].xyz() * inv_w[1];
   Vec3 c = v[2].xyz() * inv_w[2];
-  Vec3 n_over_w[3] = {vn[0] * inv_w[0], vn[1] * inv_w[1], vn[2] * inv_w[2]};
-  Vec2 uv_over_w[3] = {uv[0] * inv_w[0], uv[1] * inv_w[1], uv[2] * inv_w[2]};
-  Vec2 a_s = {hw + a.x * hw, hh + a.y * hh};
-  Vec2 b_s = {hw + b.x * hw, hh + b.y * hh};
-  Vec2 c_s = {hw + c.x * hw, hh + c.y * hh};
-  float area = signed_triangle_area(a_s, b_s, c_s);
+  Vec2 screen[3] = {{hw + a.x * hw, hh + a.y * hh},
+                    {hw + b.x * hw, hh + b.y * hh},
+                    {hw + c.x * hw, hh + c.y * hh}};
+  Point p[3];
+  for (const int &i : {0, 1, 2}) {
+    // also drops NaNs from vertices on the camera plane
+    if (!(std::abs(screen[i].x) < GUARD_BAND &&
+          std::abs(screen[i].y) < GUARD_BAND))
+      return false;
+    p[i] = {static_cast<int64_t>(std::floor(screen[i].x * SUBPIXEL + 0.5f)),
+            static_cast<int64_t>(std::floor(screen[i].y * SUBPIXEL + 0.5f))};
+  }
+  int64_t area = signed_triangle_area(p[0], p[1], p[2]);
   // back-culling
   if (area <= 0)
+    return false;
+  float inv_area = float(SUBPIXEL * SUBPIXEL) / area;
+  tri.zmin = std::min(a.z, std::min(b.z, c.z));
+  int64_t xmin = std::min(p[0].x, std::min(p[1].x, p[2].x));
+  int64_t xmax = std::max(p[0].x, std::max(p[1].x, p[2].x));
+  int64_t ymin = std::min(p[0].y, std::min(p[1].y, p[2].y));
+  int64_t ymax = std::max(p[0].y, std::max(p[1].y, p[2].y));
+  // pixels whose centres fall inside the bounding box; slivers that miss
+  // every centre are dropped before any attribute setup
+  const int half = SUBPIXEL / 2;
+  tri.x0 = std::max<int64_t>(0, -floor_div(half - xmin, SUBPIXEL));
+  tri.x1 = std::min<int64_t>(width - 1, floor_div(xmax - half, SUBPIXEL));
+  tri.y0 = std::max<int64_t>(0, -floor_div(half - ymin, SUBPIXEL));
+  tri.y1 = std::min<int64_t>(height - 1, floor_div(ymax - half, SUBPIXEL));
+  if (tri.x0 > tri.x1 || tri.y0 > tri.y1)
+    return false;
+  // hidden triangles are dropped before the plane setup when drawing
+  // immediately; while binning the coarse depth is still clear
+  if (!hiz_visible(tri.zmin, tri.x0, tri.y0, tri.x1, tri.y1))
+    return false;
+
+  // edge functions e(x, y) = e_dx * x + e_dy * y + c for the edges opposite
+  // a, b and c, evaluated at the first pixel centre and then stepped a whole
+  // pixel at a time. the float copies, in pixels, feed the planes below
+  Point from[3] = {p[1], p[2], p[0]}, to[3] = {p[2], p[0], p[1]};
+  int64_t cx = int64_t(tri.x0) * SUBPIXEL + half;
+  int64_t cy = int64_t(tri.y0) * SUBPIXEL + half;
+  const float unit = 1.0f / SUBPIXEL;
+  float e_dx[3], e_dy[3], e_c[3];
+  for (const int &i : {0, 1, 2}) {
+    int64_t dx = from[i].y - to[i].y, dy = to[i].x - from[i].x;
+    int64_t e = dx * (cx - from[i].x) + dy * (cy - from[i].y);
+    // top-left rule: a pixel centre exactly on an edge shared by two
+    // triangles goes to only one of them, the one whose inside lies in +x
+    // of the edge, or in -y of a horizontal one
+    bool top_left = dx > 0 || (dx == 0 && dy < 0);
+    tri.e_dx[i] = dx * SUBPIXEL;
+    tri.e_dy[i] = dy * SUBPIXEL;
+    tri.e_c[i] = e - !top_left;
+    e_dx[i] = dx * unit;
+    e_dy[i] = dy * unit;
+    e_c[i] = e * unit * unit;
+  }
+  // the depth plane comes first, for the test of small triangles below
+  float vert_z[3] = {a.z, b.z, c.z};
+  tri.attr_dx[ATTR_Z] =
+      (e_dx[0] * vert_z[0] + e_dx[1] * vert_z[1] + e_dx[2] * vert_z[2]) *
+      inv_area;
+  tri.attr_dy[ATTR_Z] =
+      (e_dy[0] * vert_z[0] + e_dy[1] * vert_z[1] + e_dy[2] * vert_z[2]) *
+      inv_area;
+  tri.attr_c[ATTR_Z] =
+      (e_c[0] * vert_z[0] + e_c[1] * vert_z[1] + e_c[2] * vert_z[2]) *
+      inv_area;
+
+  // most triangles of a dense mesh at terminal size cover a pixel centre or
+  // none. their few samples are tested right here, so the empty ones skip
+  // the rest of the setup and the covered ones skip the row scan
+  tri.coverage = 0;
+  if (tri.x1 - tri.x0 <= 1 && tri.y1 - tri.y0 <= 1) {
+    for (int s = 0; s < 4; ++s) {
+      int sx = s & 1, sy = s >> 1;
+      if (tri.x0 + sx > tri.x1 || tri.y0 + sy > tri.y1)
+        continue;
+      bool inside = true;
+      for (const int &i : {0, 1, 2})
+        inside &= tri.e_c[i] + tri.e_dx[i] * sx + tri.e_dy[i] * sy >= 0;
+      tri.coverage |= inside << s;
+    }
+    if (!tri.coverage)
+      return false;
+  }
+  // flat and gouraud light here, so a small triangle whose samples are all
+  // hidden already is dropped first: drawing immediately, the depth buffer
+  // is current. while binning it is still clear
+  if (tri.coverage && lighting() != SHADING_PHONG) {
+    alignas(32) float depth[8];
+    sample_depths(tri, depth);
+    bool visible = false;
+    for (int m = tri.coverage; m; m &= m - 1) {
+      int s = __builtin_ctz(m);
+      int x = tri.x0 + (s & 1), y = tri.y0 + (s >> 1);
+      visible |= depth[s] > -1 && depth[s] <= z_buffer[y * z_width + x];
+    }
+    if (!visible)
+      return false;
+  }
+
+  tri.mat = &model.mat(face_idx);
+  // the mip level whose texels come closest to one per pixel, from the
+  // triangle's area in texels over its area in pixels
+  tri.lod = 0;
+  tri.face_texel = -1;
+  if (tri.mat->has_texture && !tri.mat->texture.mips.empty()) {
+    const Texture &tex = tri.mat->texture;
+    float du0 = uv[1].x - uv[0].x, dv0 = uv[1].y - uv[0].y;
+    float du1 = uv[2].x - uv[0].x, dv1 = uv[2].y - uv[0].y;
+    float texels = std::abs(du0 * dv1 - dv0 * du1) * tex.width * tex.height;
+    float ratio = texels * (SUBPIXEL * SUBPIXEL) / area;
+    // level 1 starts halfway to a 2x2 footprint, at a ratio of 2
+    if (ratio >= 2)
+      tri.lod = std::min<int>(std::lround(0.5f * std::log2(ratio)),
+                              tex.mips.size());
+  }
+  if (tri.mat->has_texture && area <= FACE_TEXEL_AREA) {
+    // at that level the whole face lies within about one texel, which
+    // already averages it: fetched once here instead of at every pixel
+    const Texture &tex =
+        tri.lod ? tri.mat->texture.mips[tri.lod - 1] : tri.mat->texture;
+    float u = (uv[0].x + uv[1].x + uv[2].x) / 3;
+    float v = (uv[0].y + uv[1].y + uv[2].y) / 3;
+    Color c = tex.at(std::clamp(int(u * tex.width), 0, tex.width - 1),
+                     std::clamp(int((1 - v) * tex.height), 0, tex.height - 1));
+    tri.face_texel = c.r | c.g << 8 | c.b << 16;
+  }
+  // lit once per distinct corner or once per triangle instead of per
+  // pixel: the lit colour takes the normal's place in the planes
+  float ao[3];
+  for (const int &i : {0, 1, 2})
+    ao[i] = model.occlusion(face_idx, i);
+  Shading mode = lighting();
+  if (mode == SHADING_GOURAUD) {
+    for (const int &i : {0, 1, 2})
+      vn[i] = light_corner(model, face_idx, i, vn[i], v[i].xyz());
+  } else if (mode == SHADING_FLAT) {
+    Vec3 centre = (v[0].xyz() + v[1].xyz() + v[2].xyz()) * (1 / 3.0f);
+    vn[0] = vn[1] = vn[2] =
+        light_point(*tri.mat, view_normal(model.face_normal(face_idx)),
+                    centre, (ao[0] + ao[1] + ao[2]) / 3);
+  } else {
+    for (const int &i : {0, 1, 2})
+      vn[i] = view_normal(vn[i]);
+  }
+
+  // screen-space planes of everything interpolated across the triangle.
+  // 1/w and z/w are affine in screen space; normals and uvs are carried
+  // divided by w and recovered with the one per-pixel reciprocal
+  // clang-format off
+  float vert_attr[N_ATTRS][3] = {
+    {inv_w[0], inv_w[1], inv_w[2]},
+    {a.z, b.z, c.z},
+    {vn[0].x * inv_w[0], vn[1].x * inv_w[1], vn[2].x * inv_w[2]},
+    {vn[0].y * inv_w[0], vn[1].y * inv_w[1], vn[2].y * inv_w[2]},
+    {vn[0].z * inv_w[0], vn[1].z * inv_w[1], vn[2].z * inv_w[2]},
+    {uv[0].x * inv_w[0], uv[1].x * inv_w[1], uv[2].x * inv_w[2]},
+    {uv[0].y * inv_w[0], uv[1].y * inv_w[1], uv[2].y * inv_w[2]},
+    {ao[0] * inv_w[0], ao[1] * inv_w[1], ao[2] * inv_w[2]},
+  };
+  // clang-format on
+  tri.nattrs = mode == SHADING_PHONG && model.occluded() ? N_ATTRS : ATTR_AO;
+  for (int k = 0; k < tri.nattrs; ++k) {
+    if (k == ATTR_Z)
+      continue;
+    const float *f = vert_attr[k];
+    tri.attr_dx[k] =
+        (e_dx[0] * f[0] + e_dx[1] * f[1] + e_dx[2] * f[2]) * inv_area;
+    tri.attr_dy[k] =
+        (e_dy[0] * f[0] + e_dy[1] * f[1] + e_dy[2] * f[2]) * inv_area;
+    tri.attr_c[k] =
+        (e_c[0] * f[0] + e_c[1] * f[1] + e_c[2] * f[2]) * inv_area;
+  }
+  return true;
+}
+
+// x^Ns for the fast specular mode. below x0, where x^Ns falls under
+// 1/4096, the power is taken as 0 and the table spans only [x0, 1], so its
+// resolution follows the highlight however sharp it is. interpolated
+// linearly the error stays under 2.5e-4, about 1/16 of a colour level,
+// for every Ns >= 1
+static const int SPECULAR_STEPS = 256;
+struct SpecularTable {
+  float x0, scale;                 // index = (x - x0) * scale
+  float value[SPECULAR_STEPS + 2]; // the last entry repeats for x = 1
+};
+
+static bool fast_specular = false;
+
+void set_fast_specular(bool enabled) { fast_specular = enabled; }
+
+// one table per shininess, built on first use. each thread remembers the
+// last one it asked for, which spares the lock for nearly every triangle
+static const SpecularTable *specular_table(float shininess) {
+  static std::mutex mutex;
+  static std::map<float, SpecularTable> tables;
+  static thread_local float last_shininess = NAN;
+  static thread_local const SpecularTable *last = nullptr;
+  if (shininess == last_shininess)
+    return last;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = tables.find(shininess);
+  if (found == tables.end()) {
+    SpecularTable &table = tables[shininess];
+    table.x0 = shininess > 0 ? std::pow(1 / 4096.0f, 1 / shininess) : 0;
+    table.scale = SPECULAR_STEPS / (1 - table.x0);
+    for (int i = 0; i <= SPECULAR_STEPS; ++i)
+      table.value[i] = std::pow(table.x0 + i / table.scale, shininess);
+    if (table.x0 > 0)
+      table.value[0] = 0;
+    table.value[SPECULAR_STEPS + 1] = table.value[SPECULAR_STEPS];
+    found = tables.find(shininess);
+  }
+  last_shininess = shininess;
+  return last = &found->second;
+}
+
+// per-triangle shading inputs, broadcast to every lane once
+struct Shader {
+  simd::f32x8 ka[3], kd[3], ks[3], shininess, base[3];
+  const Texture *tex; // sampled for the base colour when set
+  const SpecularTable *specular; // fast mode only
+  bool vertex_lit;
+  bool matcap; // the normal planes carry a lit colour
+  simd::f32x8 specular_x0, specular_scale;
+};
+
+static Shader make_shader(const Material &mat, const Color *override_color) {
+  using namespace simd;
+  Shader sh;
+  for (const int &c : {0, 1, 2}) {
+    sh.ka[c] = splat(mat.ka.data[c]);
+    sh.kd[c] = splat(mat.kd.data[c]);
+    sh.ks[c] = splat(mat.ks.data[c]);
+  }
+  sh.shininess = splat(mat.Ns);
+  Color flat = override_color ? *override_color
+                              : Color{(unsigned char)(mat.kd.x * 255),
+                                      (unsigned char)(mat.kd.y * 255),
+                                      (unsigned char)(mat.kd.z * 255)};
+  sh.base[0] = splat(flat.r), sh.base[1] = splat(flat.g);
+  sh.base[2] = splat(flat.b);
+  sh.tex = !override_color && mat.has_texture ? &mat.texture : nullptr;
+  sh.vertex_lit = lighting() != SHADING_PHONG;
+  sh.matcap = !matcap[0].empty();
+  sh.specular = fast_specular && !sh.vertex_lit && !sh.matcap
+                    ? specular_table(mat.Ns)
+                    : nullptr;
+  if (sh.specular) {
+    sh.specular_x0 = splat(sh.specular->x0);
+    sh.specular_scale = splat(sh.specular->scale);
+  }
+  return sh;
+}
+
+// phong lighting of 8 pixels from their interpolated normals: the factor
+// applied to each channel of the base colour
+static inline void light_pixels(const Shader &sh,
+                                const simd::f32x8 at[N_ATTRS], simd::f32x8 w,
+                                simd::f32x8 ndc_x, simd::f32x8 ndc_y,
+                                bool occluded, simd::f32x8 lit[3]) {
+  using namespace simd;
+  const f32x8 zero = splat(0), one = splat(1);
+  const f32x8 light[3] = {splat(light_dir.x), splat(light_dir.y),
+                          splat(light_dir.z)};
+
+  f32x8 nx = at[ATTR_NX] * w, ny = at[ATTR_NY] * w, nz = at[ATTR_NZ] * w;
+  f32x8 inv_len = rsqrt(nx * nx + ny * ny + nz * nz);
+  nx = nx * inv_len, ny = ny * inv_len, nz = nz * inv_len;
+  f32x8 n_dot_l = nx * light[0] + ny * light[1] + nz * light[2];
+  f32x8 diff = max(n_dot_l, zero);
+
+  // camera sits at the origin, so the view vector is -position
+  f32x8 vx = zero - ndc_x * w, vy = zero - ndc_y * w,
+        vz = zero - at[ATTR_Z] * w;
+  inv_len = rsqrt(vx * vx + vy * vy + vz * vz);
+  vx = vx * inv_len, vy = vy * inv_len, vz = vz * inv_len;
+
+  f32x8 twice = n_dot_l + n_dot_l;
+  f32x8 rx = nx * twice - light[0], ry = ny * twice - light[1],
+        rz = nz * twice - light[2];
+  inv_len = rsqrt(rx * rx + ry * ry + rz * rz);
+  f32x8 r_dot_v = (rx * vx + ry * vy + rz * vz) * inv_len;
+  f32x8 spec;
+  if (sh.specular) {
+    f32x8 t = clamp((r_dot_v - sh.specular_x0) * sh.specular_scale, zero,
+                    splat(SPECULAR_STEPS));
+    i32x8 i = to_int(t);
+    f32x8 lo = gather(sh.specular->value, i);
+    f32x8 hi = gather(sh.specular->value + 1, i);
+    spec = lo + (hi - lo) * (t - to_float(i));
+  } else {
+    spec = pow(max(r_dot_v, zero), sh.shininess);
+  }
+  f32x8 ka[3] = {sh.ka[0], sh.ka[1], sh.ka[2]};
+  if (occluded) {
+    // baked occlusion only dims the ambient term
+    f32x8 ao = at[ATTR_AO] * w;
+    for (const int &c : {0, 1, 2})
+      ka[c] = ka[c] * ao;
+  }
+  for (const int &c : {0, 1, 2})
+    lit[c] = min(ka[c] + sh.kd[c] * diff + sh.ks[c] * spec, one);
+}
+
+// matcap colours of 8 pixels from their interpolated normals
+static inline void matcap_pixels(const simd::f32x8 at[N_ATTRS], simd::f32x8 w,
+                                 simd::f32x8 colour[3]) {
+  using namespace simd;
+  const f32x8 zero = splat(0), last = splat(MATCAP_SIZE - 1),
+              half = splat(MATCAP_SIZE / 2),
+              radius = splat(MATCAP_SIZE / 2 - 0.5f);
+  f32x8 nx = at[ATTR_NX] * w, ny = at[ATTR_NY] * w, nz = at[ATTR_NZ] * w;
+  f32x8 scale = rsqrt(nx * nx + ny * ny + nz * nz) * radius;
+  i32x8 i = to_int(clamp(nx * scale + half, zero, last));
+  i32x8 j = to_int(clamp(ny * scale + half, zero, last));
+  i32x8 idx = j * splat_i(MATCAP_SIZE) + i;
+  for (const int &c : {0, 1, 2})
+    colour[c] = gather(matcap[c].data(), idx);
+}
+
+static bool bilinear = false;
+
+void set_bilinear(bool enabled) { bilinear = enabled; }
+
+// the texels at (x, y), widened to one vector per channel. every lane's
+// coordinates are in range, so all 8 are fetched
+static inline void fetch(const Texture &tex, simd::i32x8 x, simd::i32x8 y,
+                         simd::f32x8 texel[3]) {
+  using namespace simd;
+  static_assert(Texture::TILE == 4, "tile coordinates are taken by shifts");
+  const i32x8 low = splat_i(3);
+  i32x8 tile = shr<2>(y) * splat_i(tex.tiles_x) + shr<2>(x);
+  i32x8 offset = shl<2>(y & low) | (x & low);
+  if (tex.compact()) {
+    // the texel's 2-bit step between the block's two rgb565 endpoints
+    i32x8 block = shl<1>(tile);
+    i32x8 ends = gather(tex.blocks.data(), block);
+    i32x8 weights = gather(tex.blocks.data(), block + splat_i(1));
+    f32x8 t = to_float(shr(weights, shl<1>(offset)) & low) * splat(1 / 3.0f);
+    const i32x8 five = splat_i(31), six = splat_i(63);
+    i32x8 code[2] = {ends & splat_i(0xffff), shr<16>(ends)};
+    f32x8 e[2][3];
+    for (const int &i : {0, 1}) {
+      e[i][0] = to_float(shr<11>(code[i]) & five) * splat(255 / 31.0f);
+      e[i][1] = to_float(shr<5>(code[i]) & six) * splat(255 / 63.0f);
+      e[i][2] = to_float(code[i] & five) * splat(255 / 31.0f);
+    }
+    for (const int &c : {0, 1, 2})
+      texel[c] = e[0][c] + (e[1][c] - e[0][c]) * t;
+    return;
+  }
+  i32x8 packed = gather(tex.texels(), shl<4>(tile) | offset);
+  const i32x8 byte = splat_i(0xff);
+  texel[0] = to_float(packed & byte);
+  texel[1] = to_float(shr<8>(packed) & byte);
+  texel[2] = to_float(shr<16>(packed));
+}
+
+// the colour at (u, v), clamped to the edges, from the nearest texel or
+// blended from the four around it
+static inline void sample(const Texture &tex, simd::f32x8 u, simd::f32x8 v,
+                          simd::f32x8 colour[3]) {
+  using namespace simd;
+  const f32x8 zero = splat(0), one = splat(1);
+  const f32x8 last_x = splat(tex.width - 1), last_y = splat(tex.height - 1);
+  f32x8 tx = u * splat(tex.width), ty = (one - v) * splat(tex.height);
+  if (!bilinear) {
+    tx = clamp(tx, zero, last_x), ty = clamp(ty, zero, last_y);
+    fetch(tex, to_int(tx), to_int(ty), colour);
     return;
-  float inv_area = 1.0f / area;
-  float xmin = std::min(a_s.x, std::min(b_s.x, c_s.x));
-  float xmax = std::max(a_s.x, std::max(b_s.x, c_s.x));
-  float ymin = std::min(a_s.y, std::min(b_s.y, c_s.y));
-  float ymax = std::max(a_s.y, std::max(b_s.y, c_s.y));
-
-  for (int x = std::max(0, static_cast<int>(xmin));
-       x <= std::min(width - 1, static_cast<int>(xmax)); ++x) {
-    for (int y = std::max(0, static_cast<int>(ymin));
-         y <= std::min(height - 1, static_cast<int>(ymax)); ++y) {
-      // clang-format off
-          float alpha = signed_triangle_area(Vec2{x + 0.5f, y + 0.5f}, b_s, c_s) * inv_area;
-          float beta = signed_triangle_area(a_s, Vec2{x + 0.5f, y + 0.5f}, c_s) * inv_area;
-          float gamma = signed_triangle_area(a_s, b_s, Vec2{x + 0.5f, y + 0.5f}) * inv_area;
-      // clang-format on
-      if (alpha < 0 || beta < 0 || gamma < 0)
+  }
+  // texel centres sit at half coordinates
+  const f32x8 half = splat(0.5f);
+  tx = clamp(tx - half, zero, last_x), ty = clamp(ty - half, zero, last_y);
+  f32x8 x0 = floor(tx), y0 = floor(ty), fx = tx - x0, fy = ty - y0;
+  i32x8 col[2] = {to_int(x0), to_int(min(x0 + one, last_x))};
+  i32x8 row[2] = {to_int(y0), to_int(min(y0 + one, last_y))};
+  f32x8 t00[3], t01[3], t10[3], t11[3];
+  fetch(tex, col[0], row[0], t00);
+  fetch(tex, col[1], row[0], t01);
+  fetch(tex, col[0], row[1], t10);
+  fetch(tex, col[1], row[1], t11);
+  for (const int &c : {0, 1, 2}) {
+    f32x8 top = t00[c] + (t01[c] - t00[c]) * fx;
+    f32x8 bottom = t10[c] + (t11[c] - t10[c]) * fx;
+    colour[c] = top + (bottom - top) * fy;
+  }
+}
+
+// lights the lanes set in mask from their interpolated attributes and
+// writes them to out[0..7]
+static inline void shade(const Shader &sh, const Triangle &tri,
+                         const simd::f32x8 at[N_ATTRS], simd::f32x8 ndc_x,
+                         simd::f32x8 ndc_y, int mask, Color *out) {
+  using namespace simd;
+  const f32x8 zero = splat(0), one = splat(1);
+  f32x8 w = one / at[ATTR_INV_W];
+  f32x8 u = at[ATTR_U] * w, v = at[ATTR_V] * w;
+  f32x8 lit[3], base[3] = {sh.base[0], sh.base[1], sh.base[2]};
+  if (sh.matcap) {
+    // the lookup is the whole colour, so nothing is lit or textured
+    matcap_pixels(at, w, base);
+    lit[0] = lit[1] = lit[2] = one;
+  } else if (sh.vertex_lit) {
+    for (const int &c : {0, 1, 2})
+      lit[c] = at[ATTR_R + c] * w;
+  } else {
+    light_pixels(sh, at, w, ndc_x, ndc_y, tri.nattrs > ATTR_AO, lit);
+  }
+
+  if (sh.tex && !sh.matcap) {
+    if (tri.face_texel >= 0)
+      for (const int &c : {0, 1, 2})
+        base[c] = splat(tri.face_texel >> 8 * c & 0xff);
+    else
+      sample(tri.lod ? sh.tex->mips[tri.lod - 1] : *sh.tex, u, v, base);
+  }
+
+  const f32x8 scale = splat(brightness), full = splat(255);
+  alignas(32) int32_t rgb[3][8];
+  for (const int &c : {0, 1, 2})
+    store(rgb[c], to_int(clamp(base[c] * lit[c] * scale, zero, full)));
+  for (int m = mask; m; m &= m - 1) {
+    int i = __builtin_ctz(m);
+    out[i] = {(unsigned char)rgb[0][i], (unsigned char)rgb[1][i],
+              (unsigned char)rgb[2][i]};
+  }
+}
+
+// triangle id of every pixel for deferred shading
+static const uint32_t NO_TRIANGLE = UINT32_MAX;
+static std::vector<uint32_t> vis_buffer;
+static bool deferred = false;
+
+void set_deferred(bool enabled) { deferred = enabled; }
+
+// normalised device coordinate of the centres of 8 pixels from p on
+static inline simd::f32x8 pixel_ndc(simd::f32x8 p, float half,
+                                    float inv_half) {
+  using namespace simd;
+  return (p + splat(0.5f - half)) * splat(inv_half);
+}
+
+// a triangle whose covered samples setup already found: the ones inside
+// the rectangle are depth tested one by one and then shaded as one group
+template <bool visibility>
+static void scan_small(const Triangle &tri, uint32_t id,
+                       std::vector<Color> &frame, int width, float hw,
+                       float hh, int x0, int y0, int x1, int y1,
+                       const Color *override_color) {
+  using namespace simd;
+  alignas(32) float sx[8] = {}, sy[8] = {}, depth[8];
+  sample_depths(tri, depth);
+  int pixel[4], dirty[4], n = 0, ndirty = 0;
+  for (int m = tri.coverage; m; m &= m - 1) {
+    int s = __builtin_ctz(m);
+    int x = tri.x0 + (s & 1), y = tri.y0 + (s >> 1);
+    if (x < x0 || x > x1 || y < y0 || y > y1)
+      continue;
+    float z = depth[s];
+    float &stored = z_buffer[y * width + x];
+    if (!(z > -1 && z <= stored))
+      continue;
+    stored = z;
+    int block = y / HIZ_BLOCK * hiz_width + x / HIZ_BLOCK;
+    if (std::find(dirty, dirty + ndirty, block) == dirty + ndirty)
+      dirty[ndirty++] = block;
+    sx[n] = s & 1, sy[n] = s >> 1;
+    pixel[n++] = y * width + x;
+  }
+  for (int i = 0; i < ndirty; ++i)
+    update_hiz(dirty[i] % hiz_width, dirty[i] / hiz_width);
+  if (!n)
+    return;
+
+  if (visibility) {
+    for (int i = 0; i < n; ++i)
+      vis_buffer[pixel[i]] = id;
+    return;
+  }
+  f32x8 dx = load(sx), dy = load(sy), at[N_ATTRS];
+  interpolate(tri, dx, dy, 0, tri.nattrs, at);
+  f32x8 ndc_x = pixel_ndc(dx + splat(tri.x0), hw, 1.0f / hw);
+  f32x8 ndc_y = pixel_ndc(dy + splat(tri.y0), hh, 1.0f / hh);
+  Color out[8];
+  shade(make_shader(*tri.mat, override_color), tri, at, ndc_x, ndc_y,
+        (1 << n) - 1, out);
+  for (int i = 0; i < n; ++i)
+    frame[pixel[i]] = out[i];
+}
+
+// the scan shared by both kinds of pass: coverage and the coarse and
+// per-pixel depth tests, then either shading the surviving pixels or, for a
+// visibility pass, recording id as their triangle
+template <bool visibility>
+static void scan(const Triangle &tri, uint32_t id, std::vector<Color> &frame,
+                 int width, float hw, float hh, int x0, int y0, int x1, int y1,
+                 const Color *override_color) {
+  using namespace simd;
+  x0 = std::max(x0, tri.x0);
+  x1 = std::min(x1, tri.x1);
+  y0 = std::max(y0, tri.y0);
+  y1 = std::min(y1, tri.y1);
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  if (!hiz_visible(tri.zmin, x0, y0, x1, y1))
+    return;
+  if (tri.coverage) {
+    scan_small<visibility>(tri, id, frame, width, hw, hh, x0, y0, x1, y1,
+                           override_color);
+    return;
+  }
+  int bx0 = x0 / HIZ_BLOCK, bx1 = x1 / HIZ_BLOCK;
+  int by0 = y0 / HIZ_BLOCK, by1 = y1 / HIZ_BLOCK;
+
+  // per block of the current block row: hidden behind the coarse depth, or
+  // written to and due a refresh once the block row is finished. a triangle
+  // inside a single block already passed the test above
+  enum { BLOCK_HIDDEN = 1, BLOCK_DIRTY = 2 };
+  bool test_blocks = bx0 != bx1 || by0 != by1;
+  static thread_local std::vector<unsigned char> block_storage;
+  unsigned char block_local[8], *blocks = block_local;
+  if (bx1 - bx0 >= 8) {
+    block_storage.resize(bx1 - bx0 + 1);
+    blocks = block_storage.data();
+  }
+
+  int64_t e_row[3];
+  for (const int &i : {0, 1, 2})
+    e_row[i] = tri.e_c[i] + tri.e_dx[i] * (x0 - tri.x0) +
+               tri.e_dy[i] * (y0 - tri.y0);
+
+  // pixel centres in normalised device coordinates, which scaled by w give
+  // back the interpolated clip-space position
+  float inv_hw = 1.0f / hw, inv_hh = 1.0f / hh;
+
+  // everything below works on 8 pixels of a row at once
+  const f32x8 lane = ramp();
+
+  Shader sh;
+  if (!visibility)
+    sh = make_shader(*tri.mat, override_color);
+
+  for (int y = y0; y <= y1; ++y) {
+    int by = y / HIZ_BLOCK;
+    if (y == y0 || y % HIZ_BLOCK == 0)
+      for (int bx = bx0; bx <= bx1; ++bx)
+        blocks[bx - bx0] =
+            test_blocks && hiz_hidden(tri, bx, by, x0, y0, x1, y1)
+                ? BLOCK_HIDDEN
+                : 0;
+
+    // the exact span of the row where all three edges are non-negative,
+    // solved per edge from its value at x0 and its step
+    int64_t lo = 0, hi = x1 - x0;
+    for (const int &i : {0, 1, 2}) {
+      int64_t e = e_row[i], step = tri.e_dx[i];
+      if (step > 0)
+        lo = std::max(lo, -floor_div(e, step));
+      else if (step < 0)
+        hi = std::min(hi, floor_div(e, -step));
+      else if (e < 0)
+        hi = -1;
+      e_row[i] += tri.e_dy[i];
+    }
+    int row = y * width;
+    // lanes past the span are masked off
+    int start = x0 + static_cast<int>(lo), end = x0 + static_cast<int>(hi);
+    const f32x8 dy = splat(y - tri.y0);
+    const f32x8 ndc_y = pixel_ndc(splat(y), hh, inv_hh);
+
+    for (int xg = start; lo <= hi && xg <= end; xg += 8) {
+      f32x8 dx = splat(xg - tri.x0) + lane;
+      f32x8 z;
+      interpolate(tri, dx, dy, ATTR_Z, 1, &z);
+      f32x8 inside = lane <= splat(end - xg);
+      // a group straddles at most two blocks
+      unsigned char &first = blocks[xg / HIZ_BLOCK - bx0];
+      unsigned char &last = blocks[std::min(xg + 7, end) / HIZ_BLOCK - bx0];
+      if (first & last & BLOCK_HIDDEN || !bits(inside))
         continue;
 
-      float inv_w_interp =
-          alpha * inv_w[0] + beta * inv_w[1] + gamma * inv_w[2];
-      float z = (alpha * a.z * inv_w[0] + beta * b.z * inv_w[1] +
-                 gamma * c.z * inv_w[2]) /
-                inv_w_interp;
-      if (z <= -1 || z > z_buffer[y * width + x])
+      float *zrow = &z_buffer[row + xg];
+      f32x8 pass = inside & (z > splat(-1)) & (z <= load(zrow, inside));
+      int mask = bits(pass);
+      if (!mask)
         continue;
-      z_buffer[y * width + x] = z;
-
-      Vec3 n =
-          ((n_over_w[0] * alpha + n_over_w[1] * beta + n_over_w[2] * gamma) *
-           (1. / inv_w_interp))
-              .n();
-
-      Vec2 uv_interp =
-          (uv_over_w[0] * alpha + uv_over_w[1] * beta + uv_over_w[2] * gamma) *
-          (1.f / inv_w_interp);
-
-      Vec3 ka = mat.ka, kd = mat.kd, ks = mat.ks;
-      float shininess = mat.Ns;
-      Vec3 ambient = mat.ka;
-      Vec3 diff = kd * std::max(0.0f, n * light_dir);
-
-      Vec3 world_pos =
-          ((v[0].xyz() * alpha * inv_w[0] + v[1].xyz() * beta * inv_w[1] +
-            v[2].xyz() * gamma * inv_w[2]) *
-           (1 / inv_w_interp));
-
-      Vec3 view_dir = (camera_pos - world_pos).n();
-
-      Vec3 reflect_dir = ((n * (2.f * (n * light_dir))) - light_dir).n();
-      float spec_factor =
-          powf(std::max(view_dir * reflect_dir, 0.0f), shininess);
-      Vec3 spec = ks * spec_factor;
-
-      Vec3 color_rgb = ambient + diff + spec;
-
-      color_rgb.x = std::min(color_rgb.x, 1.0f);
-      color_rgb.y = std::min(color_rgb.y, 1.0f);
-      color_rgb.z = std::min(color_rgb.z, 1.0f);
-
-      Color base;
-      if (override_color) {
-        base = *override_color;
-      } else if (mat.has_texture) {
-        int tx = std::clamp(int(uv_interp.x * mat.texture.width), 0,
-                            mat.texture.width - 1);
-        int ty = std::clamp(int((1.0f - uv_interp.y) * mat.texture.height), 0,
-                            mat.texture.height - 1);
-        base = mat.texture.pixels[ty * mat.texture.width + tx];
+      store(zrow, z, pass);
+      first |= BLOCK_DIRTY;
+      last |= BLOCK_DIRTY;
+
+      if (visibility) {
+        uint32_t *ids = &vis_buffer[row + xg];
+        for (int m = mask; m; m &= m - 1)
+          ids[__builtin_ctz(m)] = id;
       } else {
-        base = {
-            (unsigned char)(mat.kd.x * 255),
-            (unsigned char)(mat.kd.y * 255),
-            (unsigned char)(mat.kd.z * 255),
-        };
+        f32x8 at[N_ATTRS];
+        interpolate(tri, dx, dy, 0, tri.nattrs, at);
+        shade(sh, tri, at, pixel_ndc(splat(xg) + lane, hw, inv_hw), ndc_y,
+              mask, &frame[row + xg]);
       }
+    }
+
+    if (y % HIZ_BLOCK == HIZ_BLOCK - 1 || y == y1)
+      for (int bx = bx0; bx <= bx1; ++bx)
+        if (blocks[bx - bx0] & BLOCK_DIRTY)
+          update_hiz(bx, by);
+  }
+}
+
+void rasterize(const Triangle &tri, std::vector<Color> &frame, int width,
+               float hw, float hh, int x0, int y0, int x1, int y1,
+               const Color *override_color) {
+  scan<false>(tri, 0, frame, width, hw, hh, x0, y0, x1, y1, override_color);
+}
+
+// visibility pass: depth and triangle id only
+static void rasterize_id(const Triangle &tri, uint32_t id, int width,
+                         float hw, float hh, int x0, int y0, int x1, int y1) {
+  static std::vector<Color> unused;
+  scan<true>(tri, id, unused, width, hw, hh, x0, y0, x1, y1, nullptr);
+}
+
+// pixels across and down that share one shaded sample in deferred mode
+// where a whole block shows one triangle
+static int rate_x = 1, rate_y = 1;
+
+void set_shading_rate(int columns, int rows) {
+  rate_x = columns;
+  rate_y = rows;
+}
 
-      Color shaded = {(unsigned char)std::clamp(
-                          (base.r * color_rgb.x * brightness), 0.f, 255.f),
-                      (unsigned char)std::clamp(
-                          (base.g * color_rgb.y * brightness), 0.f, 255.f),
-                      (unsigned char)std::clamp(
-                          (base.b * color_rgb.z * brightness), 0.f, 255.f)};
+// up to 8 samples anywhere on screen, of triangles that shade alike: the
+// same material, mip level and face texel. each stands for the pixel at
+// pixel[i] and, when set, the one right of it and the ones below, and is
+// taken at the centre of those
+struct SampleBatch {
+  alignas(32) float at[N_ATTRS][8];
+  alignas(32) float ndc_x[8], ndc_y[8];
+  int pixel[8];
+  bool wide[8], tall[8];
+  const Triangle *tri = nullptr; // the first sample's
+  int n = 0;
 
-      frame[y * width + x] = shaded;
+  bool fits(const Triangle &t) const {
+    return !n || (t.mat == tri->mat && t.lod == tri->lod &&
+                  t.face_texel == tri->face_texel);
+  }
+  void add(const Triangle &t, int px, int py, bool w, bool h, int width,
+           float hw, float hh, float inv_hw, float inv_hh) {
+    float fx = px - t.x0 + (w ? 0.5f : 0.0f);
+    float fy = py - t.y0 + (h ? 0.5f : 0.0f);
+    // through interpolate like every other pass, taking one lane
+    simd::f32x8 plane[N_ATTRS];
+    interpolate(t, simd::splat(fx), simd::splat(fy), 0, t.nattrs, plane);
+    alignas(32) float lanes[8];
+    for (int k = 0; k < t.nattrs; ++k) {
+      simd::store(lanes, plane[k]);
+      at[k][n] = lanes[0];
     }
+    ndc_x[n] = (px + (w ? 1.0f : 0.5f) - hw) * inv_hw;
+    ndc_y[n] = (py + (h ? 1.0f : 0.5f) - hh) * inv_hh;
+    pixel[n] = py * width + px;
+    wide[n] = w, tall[n] = h;
+    if (!n++)
+      tri = &t;
   }
-}
\ No newline at end of file
+};
+
+static void shade_batch(const Shader &sh, SampleBatch &batch,
+                        std::vector<Color> &frame, int width) {
+  using namespace simd;
+  if (!batch.n)
+    return;
+  f32x8 at[N_ATTRS];
+  for (int k = 0; k < batch.tri->nattrs; ++k)
+    at[k] = load(batch.at[k]);
+  Color out[8];
+  shade(sh, *batch.tri, at, load(batch.ndc_x), load(batch.ndc_y),
+        (1 << batch.n) - 1, out);
+  for (int i = 0; i < batch.n; ++i) {
+    Color *p = &frame[batch.pixel[i]];
+    p[0] = out[i];
+    if (batch.wide[i])
+      p[1] = out[i];
+    if (batch.tall[i]) {
+      p[width] = out[i];
+      if (batch.wide[i])
+        p[width + 1] = out[i];
+    }
+  }
+  batch.n = 0;
+}
+
+// shading pass of deferred mode: every pixel left with a triangle id is
+// shaded exactly once, walking runs of pixels that share a triangle. ids
+// number the triangles of all chunks in order, starting at first_id[chunk]
+static void resolve(const std::vector<std::vector<Triangle>> &tris,
+                    const std::vector<uint32_t> &first_id,
+                    std::vector<Color> &frame, int width, float hw, float hh,
+                    int x0, int y0, int x1, int y1,
+                    const Color *override_color) {
+  using namespace simd;
+  const f32x8 lane = ramp();
+  float inv_hw = 1.0f / hw, inv_hh = 1.0f / hh;
+  // neighbouring runs mostly share a material, so its shader is kept
+  const Material *mat = nullptr;
+  Shader sh;
+  auto find = [&](uint32_t id) -> const Triangle & {
+    int chunk = std::upper_bound(first_id.begin(), first_id.end(), id) -
+                first_id.begin() - 1;
+    return tris[chunk][id - first_id[chunk]];
+  };
+  auto use = [&](const Triangle &tri) {
+    if (tri.mat != mat)
+      sh = make_shader(*tri.mat, override_color), mat = tri.mat;
+  };
+  // with a coarser rate, samples of neighbouring triangles share lanes
+  SampleBatch batch;
+  auto add = [&](const Triangle &tri, int x, int y, bool wide, bool tall) {
+    if (!batch.fits(tri))
+      shade_batch(sh, batch, frame, width);
+    use(tri);
+    batch.add(tri, x, y, wide, tall, width, hw, hh, inv_hw, inv_hh);
+    if (batch.n == 8)
+      shade_batch(sh, batch, frame, width);
+  };
+
+  for (int y = y0; y <= y1; ++y) {
+    int row = y * width;
+    if (rate_y == 2 && y % 2 == 0 && y < y1) {
+      // a row pair, which in the terminal is one row of cells: each run
+      // of the upper row takes along the pixels below that show the same
+      // triangle, then what is left of the lower row is shaded alone
+      const uint32_t *top = &vis_buffer[row], *bottom = top + width;
+      for (int x = x0, end; x <= x1; x = end) {
+        uint32_t id = top[x];
+        for (end = x + 1; end <= x1 && top[end] == id; ++end)
+          ;
+        if (id == NO_TRIANGLE)
+          continue;
+        const Triangle &tri = find(id);
+        for (int c = x; c < end; ++c) {
+          bool tall = bottom[c] == id;
+          // blocks start on even columns whatever the run, so tiles and
+          // threads pair the same pixels
+          bool wide = tall && rate_x == 2 && c % 2 == 0 && c + 1 < end &&
+                      bottom[c + 1] == id;
+          add(tri, c, y, wide, tall);
+          c += wide;
+        }
+      }
+      for (int x = x0; x <= x1; ++x)
+        if (bottom[x] != top[x] && bottom[x] != NO_TRIANGLE)
+          add(find(bottom[x]), x, y + 1, false, false);
+      shade_batch(sh, batch, frame, width);
+      ++y;
+      continue;
+    }
+
+    const f32x8 ndc_y = pixel_ndc(splat(y), hh, inv_hh);
+    for (int x = x0, end; x <= x1; x = end) {
+      uint32_t id = vis_buffer[row + x];
+      for (end = x + 1; end <= x1 && vis_buffer[row + end] == id; ++end)
+        ;
+      if (id == NO_TRIANGLE)
+        continue;
+      const Triangle &tri = find(id);
+      use(tri);
+
+      const f32x8 dy = splat(y - tri.y0);
+      for (int xg = x; xg < end; xg += 8) {
+        int n = std::min(8, end - xg);
+        f32x8 dx = splat(xg - tri.x0) + lane, at[N_ATTRS];
+        interpolate(tri, dx, dy, 0, tri.nattrs, at);
+        shade(sh, tri, at, pixel_ndc(splat(xg) + lane, hw, inv_hw), ndc_y,
+              (1 << n) - 1, &frame[row + xg]);
+      }
+    }
+  }
+}
+
+static void clear_ids(int width, int x0, int y0, int x1, int y1) {
+  for (int y = y0; y <= y1; ++y)
+    std::fill(&vis_buffer[y * width + x0], &vis_buffer[y * width + x1] + 1,
+              NO_TRIANGLE);
+}
+
+void rasterize(const Model &model, int face_idx, Vec4 v[3], Vec3 vn[3],
+               Vec2 uv[3], std::vector<Color> &frame, int width, float hw,
+               int height, float hh, const Color *override_color) {
+  Triangle tri;
+  if (setup_triangle(model, face_idx, v, vn, uv, width, hw, height, hh, tri))
+    rasterize(tri, frame, width, hw, hh, 0, 0, width - 1, height - 1,
+              override_color);
+}
+
+// screen tiles small enough that their slice of the frame and depth buffer
+// stays in cache while every triangle binned to them is drawn
+static const int TILE_W = 32, TILE_H = 16;
+// face ranges per thread for setup, so uneven culling still balances
+static const int CHUNKS_PER_THREAD = 4;
+
+static ThreadPool *pool = nullptr;
+
+void set_threads(int count) {
+  delete pool;
+  pool = count > 1 ? new ThreadPool(count) : nullptr;
+}
+
+// coarse front-to-back order: the model's clusters sorted by the view depth
+// of their centres, so near surfaces fill the depth buffer first and hide
+// what is drawn after them before it is shaded. cluster_start is where each
+// sorted cluster begins in the resulting face order
+static std::vector<int> cluster_order, cluster_start;
+
+static void sort_clusters(const Model &m) {
+  const std::vector<Cluster> &clusters = m.face_clusters();
+  int n = clusters.size();
+  static std::vector<float> depth;
+  static std::vector<uint16_t> key;
+  static std::vector<int> tmp;
+  depth.resize(n);
+  key.resize(n);
+  tmp.resize(n);
+  cluster_order.resize(n);
+  cluster_start.resize(n);
+
+  // clip w grows with distance from the camera
+  float lo = INFINITY, hi = -INFINITY;
+  for (int i = 0; i < n; ++i) {
+    depth[i] = clip(clusters[i].centre).w;
+    lo = std::min(lo, depth[i]);
+    hi = std::max(hi, depth[i]);
+  }
+  float scale = hi > lo ? 65535 / (hi - lo) : 0;
+  for (int i = 0; i < n; ++i) {
+    key[i] = static_cast<uint16_t>((depth[i] - lo) * scale);
+    cluster_order[i] = i;
+  }
+
+  // radix sort of the 16-bit keys, a byte per stable counting pass
+  for (int shift = 0; shift < 16; shift += 8) {
+    int count[257] = {};
+    for (int i = 0; i < n; ++i)
+      ++count[(key[cluster_order[i]] >> shift & 0xff) + 1];
+    for (int b = 0; b < 256; ++b)
+      count[b + 1] += count[b];
+    for (int i = 0; i < n; ++i)
+      tmp[count[key[cluster_order[i]] >> shift & 0xff]++] = cluster_order[i];
+    cluster_order.swap(tmp);
+  }
+
+  for (int i = 0, total = 0; i < n; ++i) {
+    cluster_start[i] = total;
+    total += clusters[cluster_order[i]].end - clusters[cluster_order[i]].begin;
+  }
+}
+
+// calls fn with each face at positions [begin, end) of the sorted order
+template <typename Fn>
+static void for_each_face(const Model &m, int begin, int end, Fn fn) {
+  const std::vector<Cluster> &clusters = m.face_clusters();
+  int k = std::upper_bound(cluster_start.begin(), cluster_start.end(), begin) -
+          cluster_start.begin() - 1;
+  for (int pos = begin; pos < end; ++k) {
+    const Cluster &c = clusters[cluster_order[k]];
+    int f = c.begin + pos - cluster_start[k];
+    int last = std::min(c.end, f + end - pos);
+    for (; f < last; ++f, ++pos)
+      fn(f);
+  }
+}
+
+// out of line, like setup_triangle, so the serial and threaded paths
+// transform a face with the same instructions
+__attribute__((noinline)) static void
+fetch_triangle(const Model &m, int f, Vec4 c[3], Vec3 vn[3], Vec2 uvs[3]) {
+  for (int i = 0; i < 3; ++i) {
+    c[i] = clip(m.vert(f, i));
+    vn[i] = m.vert_normal(f, i);
+    uvs[i] = m.vert_texture(f, i);
+  }
+}
+
+void draw_model(const Model &m, std::vector<Color> &frame, int width,
+                int height, const Color *override_color) {
+  float hw = width / 2.f, hh = height / 2.f;
+
+  static std::vector<std::vector<Triangle>> tris;
+  static std::vector<uint32_t> first_id;
+  if (deferred)
+    vis_buffer.resize(size_t(width) * height);
+  sort_clusters(m);
+  if (lighting() == SHADING_GOURAUD)
+    prepare_corners(m);
+
+  if (!pool && !deferred) {
+    for_each_face(m, 0, m.nfaces(), [&](int f) {
+      Vec4 c[3];
+      Vec3 vn[3];
+      Vec2 uvs[3];
+      fetch_triangle(m, f, c, vn, uvs);
+      rasterize(m, f, c, vn, uvs, frame, width, hw, height, hh,
+                override_color);
+    });
+    return;
+  }
+
+  if (!pool) {
+    // deferred on one thread: the set-up triangles are kept for the
+    // shading pass, which reads them back by id
+    tris.resize(1);
+    first_id.assign(1, 0);
+    std::vector<Triangle> &out = tris[0];
+    out.clear();
+    clear_ids(width, 0, 0, width - 1, height - 1);
+    for_each_face(m, 0, m.nfaces(), [&](int f) {
+      Vec4 c[3];
+      Vec3 vn[3];
+      Vec2 uvs[3];
+      Triangle tri;
+      fetch_triangle(m, f, c, vn, uvs);
+      if (!setup_triangle(m, f, c, vn, uvs, width, hw, height, hh, tri))
+        return;
+      rasterize_id(tri, out.size(), width, hw, hh, 0, 0, width - 1,
+                   height - 1);
+      out.push_back(tri);
+    });
+    resolve(tris, first_id, frame, width, hw, hh, 0, 0, width - 1,
+            height - 1, override_color);
+    return;
+  }
+
+  // sort-middle: set up and bin contiguous ranges of the sorted faces in
+  // parallel, then rasterize the tiles in parallel. each tile walks the
+  // chunks in order so triangles still land front to back
+  int tiles_x = (width + TILE_W - 1) / TILE_W;
+  int tiles_y = (height + TILE_H - 1) / TILE_H;
+  int ntiles = tiles_x * tiles_y;
+  int nchunks = pool->size() * CHUNKS_PER_THREAD;
+
+  static std::vector<std::vector<uint32_t>> bins; // [chunk * ntiles + tile]
+  tris.resize(nchunks);
+  bins.resize(nchunks * ntiles);
+
+  pool->run(nchunks, [&](int chunk) {
+    int begin = (long long)m.nfaces() * chunk / nchunks;
+    int end = (long long)m.nfaces() * (chunk + 1) / nchunks;
+    std::vector<Triangle> &out = tris[chunk];
+    std::vector<uint32_t> *chunk_bins = &bins[chunk * ntiles];
+    out.clear();
+    for (int t = 0; t < ntiles; ++t)
+      chunk_bins[t].clear();
+
+    for_each_face(m, begin, end, [&](int f) {
+      Vec4 c[3];
+      Vec3 vn[3];
+      Vec2 uvs[3];
+      Triangle tri;
+      fetch_triangle(m, f, c, vn, uvs);
+      if (!setup_triangle(m, f, c, vn, uvs, width, hw, height, hh, tri))
+        return;
+      uint32_t idx = out.size();
+      out.push_back(tri);
+      for (int ty = tri.y0 / TILE_H; ty <= tri.y1 / TILE_H; ++ty)
+        for (int tx = tri.x0 / TILE_W; tx <= tri.x1 / TILE_W; ++tx)
+          chunk_bins[ty * tiles_x + tx].push_back(idx);
+    });
+  });
+
+  first_id.resize(nchunks);
+  for (int chunk = 0, total = 0; chunk < nchunks; ++chunk) {
+    first_id[chunk] = total;
+    total += tris[chunk].size();
+  }
+
+  pool->run(ntiles, [&](int tile) {
+    int x0 = (tile % tiles_x) * TILE_W, y0 = (tile / tiles_x) * TILE_H;
+    int x1 = std::min(width, x0 + TILE_W) - 1;
+    int y1 = std::min(height, y0 + TILE_H) - 1;
+    if (deferred) {
+      clear_ids(width, x0, y0, x1, y1);
+      for (int chunk = 0; chunk < nchunks; ++chunk)
+        for (uint32_t idx : bins[chunk * ntiles + tile])
+          rasterize_id(tris[chunk][idx], first_id[chunk] + idx, width, hw,
+                       hh, x0, y0, x1, y1);
+      resolve(tris, first_id, frame, width, hw, hh, x0, y0, x1, y1,
+              override_color);
+      return;
+    }
+    for (int chunk = 0; chunk < nchunks; ++chunk)
+      for (uint32_t idx : bins[chunk * ntiles + tile])
+        rasterize(tris[chunk][idx], frame, width, hw, hh, x0, y0, x1, y1,
+                  override_color);
+  });
+}
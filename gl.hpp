@@ -1,8 +1,48 @@
 #pragma once
 #include "Model.hpp"
 #include "geom.hpp"
+#include <cstdint>
 #include <vector>
 
+// attributes interpolated across a triangle by their screen-space planes
+enum {
+  ATTR_INV_W,
+  ATTR_Z,
+  ATTR_NX,
+  ATTR_NY,
+  ATTR_NZ,
+  ATTR_U,
+  ATTR_V,
+  ATTR_AO,
+  N_ATTRS
+};
+// lit per vertex or per triangle, the normal planes carry the lit colour
+enum { ATTR_R = ATTR_NX, ATTR_G, ATTR_B };
+
+// where lighting is evaluated: once per triangle, per vertex with the
+// colour interpolated, or per pixel from the interpolated normal
+enum Shading { SHADING_FLAT, SHADING_GOURAUD, SHADING_PHONG };
+
+// a set-up triangle: its pixel bounding box plus edge functions and
+// attribute planes, the constant terms taken at the centre of (x0, y0).
+// edges are exact integers in squared sub-pixel units with the fill rule
+// folded into e_c, so a pixel is covered when all three are non-negative
+struct Triangle {
+  const Material *mat;
+  int x0, y0, x1, y1;
+  float zmin; // nearest vertex depth
+  int64_t e_dx[3], e_dy[3], e_c[3];
+  // for a bounding box of at most 2x2 pixels the samples it covers, bit
+  // 2 * row + column; 0 for larger triangles
+  unsigned char coverage;
+  unsigned char lod; // mip level its texture is sampled from
+  // packed 0x00bbggrr texel standing for a sub-pixel face, or -1 to sample
+  int32_t face_texel;
+  // planes set up, N_ATTRS or ATTR_AO when no baked occlusion is read
+  unsigned char nattrs;
+  float attr_dx[N_ATTRS], attr_dy[N_ATTRS], attr_c[N_ATTRS];
+};
+
 void set_model(Vec3 pos, Vec3 rot, Vec3 scale);
 void look_at(Vec3 eye, Vec3 target, Vec3 up);
 void set_perspective(float near, float far, float aspect_ratio, float fov);
@@ -12,6 +52,25 @@ void rasterize(const Model &model, int face_idx, Vec4 v[3], Vec3 vn[3],
                int height, float hh, const Color *override_color = nullptr);
 void rasterize(Vec4 v[3], Vec3 vn[3], std::vector<Color> &frame, int width,
                float hw, int height, float hh, const Color &basecolor);
+bool setup_triangle(const Model &model, int face_idx, Vec4 v[3], Vec3 vn[3],
+                    Vec2 uv[3], int width, float hw, int height, float hh,
+                    Triangle &tri);
+void rasterize(const Triangle &tri, std::vector<Color> &frame, int width,
+               float hw, float hh, int x0, int y0, int x1, int y1,
+               const Color *override_color = nullptr);
+void draw_model(const Model &model, std::vector<Color> &frame, int width,
+                int height, const Color *override_color = nullptr);
+void set_threads(int count);
+void set_deferred(bool enabled);
+// in deferred mode, shades a block of columns x rows pixels that shows a
+// single triangle once: 1x1, 1x2 (the two pixels of a cell) or 2x2
+void set_shading_rate(int columns, int rows);
+void set_fast_specular(bool enabled);
+void set_shading(Shading mode);
+void set_bilinear(bool enabled);
+// colours every pixel from a lookup by its view-space normal into a sphere
+// image in place of the lighting, a built-in clay one when image is null
+void set_matcap(const Texture *image);
 Vec4 clip(const Vec3 &vertex);
-void reset_z_buffer(size_t size);
+void reset_z_buffer(int width, int height);
 void set_brightness(float intensity);
\ No newline at end of file
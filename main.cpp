@@ -1,7 +1,12 @@
 #include "Model.hpp"
+#include "ansi.hpp"
+#include "ao.hpp"
+#include "frame.hpp"
 #include "gl.hpp"
 
 #include <algorithm>
+#include <cerrno>
+#include <cmath>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
@@ -12,6 +17,7 @@
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <termios.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
@@ -56,27 +62,84 @@ void update_size() {
   term_width = w.ws_col;
   term_height = w.ws_row;
 
-  render_width = term_width;
-  render_height = term_height * 2;
-
   resized = 0;
   write(STDOUT_FILENO, "\033[2J", 4);
+  invalidate_screen();
+}
+
+// textures are kept up to this many times the longest render dimension,
+// enough for a model spanning the screen to be zoomed in a little
+static const int TEXTURE_HEADROOM = 4;
+
+// the longest texture side worth decoding for this terminal, 0 when its
+// size is unknown
+static int useful_texture_size(float scale) {
+  struct winsize w;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || !w.ws_col || !w.ws_row)
+    return 0;
+  return std::max<int>(w.ws_col, w.ws_row * 2) * scale * TEXTURE_HEADROOM;
 }
 
 static std::vector<Color> frame;
-static std::vector<char> output;
+// frame reduced to terminal resolution when rendered larger
+static std::vector<Color> display;
 
 static float x_model = 0, y_model = 0, z_model = -2;
 static float theta_model = 0, rho_model = 0, phi_model = 0;
 
-void render_model(const Model &m) {
+// with --adaptive, frames drawn while the model moves use this fraction of
+// the resolution, and a full frame follows once input has been idle a while
+static const float PREVIEW_SCALE = 0.5f;
+static const float REFINE_AFTER_IDLE = 0.15f; // seconds
+
+static float seconds_between(const timespec &from, const timespec &to) {
+  return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9f;
+}
+
+// with --dynamic-res, frames drawn while moving are scaled to fit the --fps
+// budget. render cost is roughly proportional to the pixel count, so the
+// scale follows the square root of budget over the smoothed frame time,
+// limited per frame so it settles instead of oscillating
+static const float MIN_DYNAMIC_SCALE = 0.25f;
+static const float BUDGET_HEADROOM = 0.85f; // leave room for the terminal
+static float dynamic_scale = 1.0f;
+static float smoothed_frame = 0; // seconds
+
+static void adjust_dynamic_scale(float seconds, float budget, float max) {
+  smoothed_frame =
+      smoothed_frame ? 0.7f * smoothed_frame + 0.3f * seconds : seconds;
+  float step = std::sqrt(budget * BUDGET_HEADROOM / smoothed_frame);
+  float up = std::floor(dynamic_scale) + 1;
+  if (dynamic_scale >= 1 && step >= 1) {
+    // supersampling draws whole factors only: the next one is taken once
+    // its cost fits the budget. timings of the old factor are dropped
+    if (up <= max && step >= up / dynamic_scale) {
+      dynamic_scale = up;
+      smoothed_frame = 0;
+    }
+  } else if (dynamic_scale > 1) {
+    dynamic_scale -= 1;
+    smoothed_frame = 0;
+  } else {
+    dynamic_scale = std::clamp(dynamic_scale * std::clamp(step, 0.8f, 1.1f),
+                               MIN_DYNAMIC_SCALE, std::min(max, 1.0f));
+  }
+}
+
+// renders at scale times the terminal resolution, then resamples to it
+void render_model(const Model &m, float scale, Shading shading) {
   static unsigned int seed = time(NULL);
   srand(seed);
 
-  if (!render_width || !render_height)
+  if (!term_width || !term_height)
     return;
+  // supersampling averages whole blocks, so above the terminal resolution
+  // only integer factors are drawn, whatever --dynamic-res settled on
+  if (scale > 1)
+    scale = std::floor(scale);
 
-  float hw = render_width / 2.f, hh = render_height / 2.f;
+  render_width = std::max(1u, (unsigned)(term_width * scale));
+  render_height = std::max(1u, (unsigned)(term_height * 2 * scale));
 
   size_t needed = render_width * render_height;
 
@@ -86,6 +149,7 @@ void render_model(const Model &m) {
     std::fill(frame.begin(), frame.end(), g_background_color);
 
   set_brightness(brightness);
+  set_shading(shading);
 
   set_model({x_model, y_model, z_model}, {theta_model, rho_model, phi_model},
             {1, 1, 1});
@@ -93,64 +157,38 @@ void render_model(const Model &m) {
   set_perspective(0.1, 100, static_cast<float>(render_width) / render_height,
                   M_PI / 3);
 
-  reset_z_buffer(needed);
-
-  for (int f = 0; f < m.nfaces(); ++f) {
-    Vec4 c[3];
-    Vec3 vn[3];
-    Vec2 uvs[3];
-    for (int i = 0; i < 3; ++i) {
-      c[i] = clip(m.vert(f, i));
-      vn[i] = m.vert_normal(f, i);
-      uvs[i] = m.vert_texture(f, i);
-    }
-
-    if (g_use_fixed_color) {
-      rasterize(m, f, c, vn, uvs, frame, render_width, hw, render_height, hh,
-                &g_fixed_color);
-    } else {
-      rasterize(m, f, c, vn, uvs, frame, render_width, hw, render_height, hh);
-    }
+  reset_z_buffer(render_width, render_height);
+
+  draw_model(m, frame, render_width, render_height,
+             g_use_fixed_color ? &g_fixed_color : nullptr);
+
+  const std::vector<Color> *image = &frame;
+  unsigned image_height = term_height * 2;
+  if (render_width > term_width) {
+    downsample(frame, render_width, render_height, render_width / term_width,
+               display);
+    image = &display;
+  } else if (render_width != term_width || render_height != image_height) {
+    upsample(frame, render_width, render_height, display, term_width,
+             image_height);
+    image = &display;
   }
 
-  output.clear();
-  output.reserve(term_width * term_height * 8);
-
-  output.insert(output.end(), "\033[H", &"\033[H"[3]);
-
-  Color last_fg{255, 255, 255};
-  Color last_bg{255, 255, 255};
-  bool first = true;
-
-  for (unsigned y = 0; y < term_height; ++y) {
-    for (unsigned x = 0; x < term_width; ++x) {
-
-      int top_i = (render_height - 1 - y * 2) * render_width + x;
-      int bottom_i = (render_height - 1 - (y * 2 + 1)) * render_width + x;
-
-      Color fg = frame[top_i];
-      Color bg = frame[bottom_i];
-
-      if (first || memcmp(&fg, &last_fg, 3) != 0) {
-        char buf[32];
-        int len = sprintf(buf, "\033[38;2;%d;%d;%dm", fg.r, fg.g, fg.b);
-        output.insert(output.end(), buf, buf + len);
-        last_fg = fg;
-      }
-
-      if (first || memcmp(&bg, &last_bg, 3) != 0) {
-        char buf[32];
-        int len = sprintf(buf, "\033[48;2;%d;%d;%dm", bg.r, bg.g, bg.b);
-        output.insert(output.end(), buf, buf + len);
-        last_bg = bg;
-      }
-
-      output.insert(output.end(), "▀", &"▀"[3]);
-      first = false;
+  // the encoder takes all it produced as shown: a short write is finished,
+  // or if the terminal will not take the rest, the next frame is drawn whole
+  std::string_view output = encode_frame(*image, term_width, term_height);
+  for (size_t done = 0; done < output.size();) {
+    ssize_t n =
+        write(STDOUT_FILENO, output.data() + done, output.size() - done);
+    if (n > 0)
+      done += n;
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else {
+      invalidate_screen();
+      break;
     }
   }
-
-  write(STDOUT_FILENO, output.data(), output.size());
 }
 
 int main(int argc, char *argv[]) {
@@ -160,21 +198,55 @@ int main(int argc, char *argv[]) {
   float rotation_speed = M_PI; // 1 rotation every 2 seconds
   float render_scale = 1.0f;
   float change_scale = 1.0f;
-
-  static struct option long_options[] = {{"fps", required_argument, 0, 'f'},
-                                         {"rotate", no_argument, 0, 'r'},
-                                         {"speed", required_argument, 0, 's'},
-                                         {"color", required_argument, 0, 'c'},
-                                         {"bcolor", required_argument, 0, 'b'},
-                                         {"help", no_argument, 0, 'h'},
-                                         {"version", no_argument, 0, 'v'},
-                                         {0, 0, 0, 0}};
+  int threads = std::thread::hardware_concurrency();
+  bool deferred = false;
+  int rate_x = 1, rate_y = 1; // pixels per shaded sample
+  bool adaptive = false;
+  bool dynamic_res = false;
+  bool fast_specular = false;
+  Shading shading = SHADING_PHONG;
+  bool bilinear = false;
+  int texture_budget_mb = 256;
+  bool compact_textures = false;
+  bool use_matcap = false;
+  const char *matcap_path = nullptr;
+  int ao_rays = 0; // no occlusion baked
+  ColorMode color_mode = detect_color_mode();
+  bool dither = false;
+  RunMode run_mode = RUNS_SPACES;
+
+  static struct option long_options[] = {
+      {"fps", required_argument, 0, 'f'},
+      {"rotate", no_argument, 0, 'r'},
+      {"speed", required_argument, 0, 's'},
+      {"color", required_argument, 0, 'c'},
+      {"bcolor", required_argument, 0, 'b'},
+      {"threads", required_argument, 0, 'j'},
+      {"deferred", no_argument, 0, 'd'},
+      {"vrs", required_argument, 0, 'V'},
+      {"ssaa", required_argument, 0, 'a'},
+      {"adaptive", no_argument, 0, 'A'},
+      {"dynamic-res", no_argument, 0, 'D'},
+      {"precision", required_argument, 0, 'p'},
+      {"shading", required_argument, 0, 'S'},
+      {"matcap", required_argument, 0, 'm'},
+      {"filter", required_argument, 0, 't'},
+      {"tex-budget", required_argument, 0, 'T'},
+      {"tex-compress", no_argument, 0, 'Z'},
+      {"ao", optional_argument, 0, 'O'},
+      {"colors", required_argument, 0, 'C'},
+      {"dither", no_argument, 0, 'x'},
+      {"runs", required_argument, 0, 'R'},
+      {"help", no_argument, 0, 'h'},
+      {"version", no_argument, 0, 'v'},
+      {0, 0, 0, 0}};
 
   int opt;
   int option_index = 0;
 
-  while ((opt = getopt_long(argc, argv, "f:rs:c:b:hv", long_options,
-                            &option_index)) != -1) {
+  while ((opt = getopt_long(argc, argv,
+                            "f:rs:c:b:j:dV:a:ADp:S:m:t:T:ZO::C:xR:hv",
+                            long_options, &option_index)) != -1) {
 
     switch (opt) {
 
@@ -198,6 +270,37 @@ int main(int argc, char *argv[]) {
              "  -s, --speed N      Rotation speed (rad/sec)\n"
              "  -c  --color R,G,B  Change display color\n"
              "  -b  --bcolor R,G,C Change background color\n"
+             "  -j, --threads N    Render threads, 1 disables tiling "
+             "(default all cores)\n"
+             "  -d, --deferred     Shade each pixel once after a visibility "
+             "pass\n"
+             "  -V, --vrs WxH      Deferred, shading blocks of one triangle "
+             "once: 1x2 or 2x2\n"
+             "  -a, --ssaa N       Supersample N x N per pixel (1-4, default "
+             "1)\n"
+             "  -A, --adaptive     Half resolution while moving, full once "
+             "idle\n"
+             "  -D, --dynamic-res  Lower resolution while moving to hold "
+             "the FPS\n"
+             "  -p, --precision P  Specular: exact or fast table (default "
+             "exact)\n"
+             "  -S, --shading M    Lighting: flat, gouraud or phong (default "
+             "phong)\n"
+             "  -m, --matcap IMG   Colour by normal from a sphere image, or "
+             "clay\n"
+             "  -t, --filter F     Texture filter: nearest or bilinear "
+             "(default nearest)\n"
+             "  -T, --tex-budget N Texture memory limit in MiB, 0 for none "
+             "(default 256)\n"
+             "  -Z, --tex-compress Keep textures as 4-bit blocks, 8x "
+             "smaller\n"
+             "  -O, --ao[=N]       Bake ambient occlusion with N rays per "
+             "vertex (default 64)\n"
+             "  -C, --colors M     Output colours: truecolor, 256 or 16 "
+             "(default from terminal)\n"
+             "  -x, --dither       Dither the 256 and 16 colour palettes\n"
+             "  -R, --runs M       Equal cells: glyphs, spaces, erase or "
+             "repeat (default spaces)\n"
              "  -h, --help         Show this help\n"
              "  -v, --version      Show version\n\n"
              "Controls (runtime):\n"
@@ -259,6 +362,119 @@ int main(int argc, char *argv[]) {
                             (unsigned char)b};
       break;
 
+    case 'j':
+      threads = std::max(1, atoi(optarg));
+      break;
+
+    case 'd':
+      deferred = true;
+      break;
+
+    case 'V':
+      if (!strcmp(optarg, "1x1"))
+        rate_x = 1, rate_y = 1;
+      else if (!strcmp(optarg, "1x2"))
+        rate_x = 1, rate_y = 2;
+      else if (!strcmp(optarg, "2x2"))
+        rate_x = 2, rate_y = 2;
+      else {
+        fprintf(stderr, "--vrs: 1x1, 1x2 or 2x2\n");
+        return 1;
+      }
+      deferred = deferred || rate_y > 1;
+      break;
+
+    case 'a':
+      render_scale = std::clamp(atoi(optarg), 1, 4);
+      break;
+
+    case 'A':
+      adaptive = true;
+      break;
+
+    case 'D':
+      dynamic_res = true;
+      break;
+
+    case 'p':
+      if (strcmp(optarg, "exact") && strcmp(optarg, "fast")) {
+        fprintf(stderr, "--precision: exact or fast\n");
+        return 1;
+      }
+      fast_specular = !strcmp(optarg, "fast");
+      break;
+
+    case 'S':
+      if (!strcmp(optarg, "flat"))
+        shading = SHADING_FLAT;
+      else if (!strcmp(optarg, "gouraud"))
+        shading = SHADING_GOURAUD;
+      else if (!strcmp(optarg, "phong"))
+        shading = SHADING_PHONG;
+      else {
+        fprintf(stderr, "--shading: flat, gouraud or phong\n");
+        return 1;
+      }
+      break;
+
+    case 'm':
+      use_matcap = true;
+      // the built-in clay sphere unless an image is named
+      matcap_path = strcmp(optarg, "clay") ? optarg : nullptr;
+      break;
+
+    case 't':
+      if (strcmp(optarg, "nearest") && strcmp(optarg, "bilinear")) {
+        fprintf(stderr, "--filter: nearest or bilinear\n");
+        return 1;
+      }
+      bilinear = !strcmp(optarg, "bilinear");
+      break;
+
+    case 'T':
+      texture_budget_mb = std::max(0, atoi(optarg));
+      break;
+
+    case 'Z':
+      compact_textures = true;
+      break;
+
+    case 'O':
+      ao_rays = optarg ? std::max(1, atoi(optarg)) : 64;
+      break;
+
+    case 'C':
+      if (!strcmp(optarg, "truecolor"))
+        color_mode = COLORS_TRUE;
+      else if (!strcmp(optarg, "256"))
+        color_mode = COLORS_256;
+      else if (!strcmp(optarg, "16"))
+        color_mode = COLORS_16;
+      else {
+        fprintf(stderr, "--colors: truecolor, 256 or 16\n");
+        return 1;
+      }
+      break;
+
+    case 'x':
+      dither = true;
+      break;
+
+    case 'R':
+      if (!strcmp(optarg, "glyphs"))
+        run_mode = RUNS_GLYPHS;
+      else if (!strcmp(optarg, "spaces"))
+        run_mode = RUNS_SPACES;
+      else if (!strcmp(optarg, "erase"))
+        run_mode = RUNS_ERASE;
+      else if (!strcmp(optarg, "repeat"))
+        run_mode = RUNS_REPEAT;
+      else {
+        fprintf(stderr, "--runs: glyphs, spaces, erase or repeat\n");
+        return 1;
+      }
+      break;
+
     default:
       return 1;
     }
@@ -273,7 +489,29 @@ int main(int argc, char *argv[]) {
   const char *model_path = argv[optind];
 
   srand(time(NULL));
-  Model m(model_path);
+  TextureLimits limits;
+  limits.max_size = useful_texture_size(render_scale);
+  limits.budget = size_t(texture_budget_mb) << 20;
+  limits.compact = compact_textures;
+  Model m(model_path, limits);
+  if (ao_rays)
+    bake_occlusion(m, ao_rays, std::max(1, threads),
+                   std::string(model_path) + ".ao");
+  set_threads(threads);
+  set_deferred(deferred);
+  set_shading_rate(rate_x, rate_y);
+  set_color_mode(color_mode, dither);
+  set_run_mode(run_mode);
+  set_fast_specular(fast_specular);
+  set_bilinear(bilinear);
+  if (use_matcap) {
+    Texture image;
+    if (matcap_path && !load_image(matcap_path, image)) {
+      fprintf(stderr, "failed to load matcap: %s\n", matcap_path);
+      return 1;
+    }
+    set_matcap(matcap_path ? &image : nullptr);
+  }
 
   struct sigaction sa{};
   sa.sa_handler = handle_resize;
@@ -284,28 +522,49 @@ int main(int argc, char *argv[]) {
 
   update_size();
 
-  // apply scale after size update
-  render_width = std::max(1u, (unsigned)(term_width * render_scale));
-  render_height = std::max(1u, (unsigned)(term_height * 2 * render_scale));
-
-  render_model(m);
+  render_model(m, render_scale, shading);
 
   const int frame_time_us = 1000000 / target_fps;
-
-  struct timespec last_time;
+  const float moving_scale = adaptive ? PREVIEW_SCALE : render_scale;
+  // adaptive previews light per vertex at most
+  const Shading moving_shading =
+      adaptive ? std::min(shading, SHADING_GOURAUD) : shading;
+  dynamic_scale = moving_scale;
+  // whether the frame on screen was rendered at full quality
+  bool refined = true;
+
+  auto render_moving = [&] {
+    if (!dynamic_res) {
+      render_model(m, moving_scale, moving_shading);
+      return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    render_model(m, dynamic_scale, moving_shading);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    adjust_dynamic_scale(seconds_between(start, end), 1.0f / target_fps,
+                         moving_scale);
+  };
+
+  struct timespec last_time, last_input;
   clock_gettime(CLOCK_MONOTONIC, &last_time);
+  last_input = last_time;
 
   while (1) {
 
     if (resized) {
       update_size();
-      render_width = std::max(1u, (unsigned)(term_width * render_scale));
-      render_height = std::max(1u, (unsigned)(term_height * 2 * render_scale));
-      render_model(m);
+      render_model(m, render_scale, shading);
+      refined = true;
     }
 
+    // wait out only what is left of the frame interval after rendering
+    struct timespec before;
+    clock_gettime(CLOCK_MONOTONIC, &before);
     struct timeval tv{};
-    tv.tv_usec = frame_time_us;
+    tv.tv_usec = std::clamp(
+        frame_time_us - (int)(seconds_between(last_time, before) * 1e6f), 0,
+        frame_time_us);
 
     fd_set set;
     FD_ZERO(&set);
@@ -316,14 +575,18 @@ int main(int argc, char *argv[]) {
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
 
-    float dt = (now.tv_sec - last_time.tv_sec) +
-               (now.tv_nsec - last_time.tv_nsec) / 1e9f;
+    float dt = seconds_between(last_time, now);
 
     last_time = now;
 
     if (auto_rotate) {
       theta_model += rotation_speed * dt;
-      render_model(m);
+      render_moving();
+      refined = !adaptive && !dynamic_res;
+    } else if (!refined &&
+               seconds_between(last_input, now) >= REFINE_AFTER_IDLE) {
+      render_model(m, render_scale, shading);
+      refined = true;
     }
 
     if (FD_ISSET(STDIN_FILENO, &set)) {
@@ -376,8 +639,11 @@ int main(int argc, char *argv[]) {
         else if (c == 'I')
           change_scale /= 2;
 
-        if (!auto_rotate)
-          render_model(m);
+        if (!auto_rotate) {
+          render_moving();
+          refined = !adaptive && !dynamic_res;
+          last_input = now;
+        }
       }
     }
   }
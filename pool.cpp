@@ -0,0 +1,55 @@
+#include "pool.hpp"
+
+ThreadPool::ThreadPool(int threads) {
+  // the calling thread takes a share of every job too
+  for (int i = 1; i < threads; ++i)
+    workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &t : workers)
+    t.join();
+}
+
+void ThreadPool::drain() {
+  for (int i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+    (*job)(i);
+}
+
+void ThreadPool::work() {
+  unsigned seen = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [&] { return stopping || generation != seen; });
+    if (stopping)
+      return;
+    seen = generation;
+    lock.unlock();
+    drain();
+    lock.lock();
+    if (--active == 0)
+      done.notify_one();
+  }
+}
+
+void ThreadPool::run(int n, const std::function<void(int)> &fn) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &fn;
+    count = n;
+    next = 0;
+    active = workers.size();
+    ++generation;
+  }
+  wake.notify_all();
+  drain();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&] { return active == 0; });
+  job = nullptr;
+}
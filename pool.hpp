@@ -0,0 +1,31 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fixed set of worker threads that split indexed jobs with the caller
+class ThreadPool {
+private:
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  const std::function<void(int)> *job = nullptr;
+  int count = 0;
+  std::atomic<int> next{0};
+  int active = 0;
+  unsigned generation = 0;
+  bool stopping = false;
+
+  void drain();
+  void work();
+
+public:
+  ThreadPool(int threads);
+  ~ThreadPool();
+  int size() const { return workers.size() + 1; }
+  // calls job(i) for every i in [0, n) and returns once all calls finished
+  void run(int n, const std::function<void(int)> &fn);
+};
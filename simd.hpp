@@ -0,0 +1,427 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace simd {
+
+// eight float lanes, one per pixel of a row segment. a single AVX2 register
+// when the build targets it, a pair of SSE2 registers otherwise and a plain
+// array anywhere else. comparisons return all-ones lanes, as the hardware
+// does, so masks are f32x8 values too
+#if defined(__AVX2__)
+
+struct f32x8 {
+  __m256 v;
+};
+struct i32x8 {
+  __m256i v;
+};
+
+inline f32x8 splat(float f) { return {_mm256_set1_ps(f)}; }
+inline i32x8 splat_i(int i) { return {_mm256_set1_epi32(i)}; }
+inline f32x8 ramp() { return {_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)}; }
+inline f32x8 load(const float *p) { return {_mm256_loadu_ps(p)}; }
+inline i32x8 load(const int32_t *p) {
+  return {_mm256_loadu_si256((const __m256i *)p)};
+}
+inline void store(float *p, f32x8 a) { _mm256_storeu_ps(p, a.v); }
+inline void store(int32_t *p, i32x8 a) {
+  _mm256_storeu_si256((__m256i *)p, a.v);
+}
+// masked lanes only; the others are neither read nor written
+inline f32x8 load(const float *p, f32x8 mask) {
+  return {_mm256_maskload_ps(p, _mm256_castps_si256(mask.v))};
+}
+inline void store(float *p, f32x8 a, f32x8 mask) {
+  _mm256_maskstore_ps(p, _mm256_castps_si256(mask.v), a.v);
+}
+
+inline f32x8 operator+(f32x8 a, f32x8 b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline f32x8 operator-(f32x8 a, f32x8 b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline f32x8 operator*(f32x8 a, f32x8 b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline f32x8 operator/(f32x8 a, f32x8 b) { return {_mm256_div_ps(a.v, b.v)}; }
+inline f32x8 min(f32x8 a, f32x8 b) { return {_mm256_min_ps(a.v, b.v)}; }
+inline f32x8 max(f32x8 a, f32x8 b) { return {_mm256_max_ps(a.v, b.v)}; }
+inline f32x8 sqrt(f32x8 a) { return {_mm256_sqrt_ps(a.v)}; }
+inline f32x8 rsqrt_estimate(f32x8 a) { return {_mm256_rsqrt_ps(a.v)}; }
+inline f32x8 floor(f32x8 a) { return {_mm256_floor_ps(a.v)}; }
+
+inline f32x8 operator<(f32x8 a, f32x8 b) {
+  return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)};
+}
+inline f32x8 operator<=(f32x8 a, f32x8 b) {
+  return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)};
+}
+inline f32x8 operator>(f32x8 a, f32x8 b) {
+  return {_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)};
+}
+inline f32x8 operator>=(f32x8 a, f32x8 b) {
+  return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)};
+}
+inline f32x8 operator&(f32x8 a, f32x8 b) { return {_mm256_and_ps(a.v, b.v)}; }
+inline f32x8 operator|(f32x8 a, f32x8 b) { return {_mm256_or_ps(a.v, b.v)}; }
+// lanes of b where mask is set, a elsewhere
+inline f32x8 select(f32x8 mask, f32x8 b, f32x8 a) {
+  return {_mm256_blendv_ps(a.v, b.v, mask.v)};
+}
+inline int bits(f32x8 mask) { return _mm256_movemask_ps(mask.v); }
+
+inline i32x8 to_int(f32x8 a) { return {_mm256_cvttps_epi32(a.v)}; }
+inline f32x8 to_float(i32x8 a) { return {_mm256_cvtepi32_ps(a.v)}; }
+inline i32x8 as_int(f32x8 a) { return {_mm256_castps_si256(a.v)}; }
+inline f32x8 as_float(i32x8 a) { return {_mm256_castsi256_ps(a.v)}; }
+inline i32x8 operator+(i32x8 a, i32x8 b) {
+  return {_mm256_add_epi32(a.v, b.v)};
+}
+inline i32x8 operator-(i32x8 a, i32x8 b) {
+  return {_mm256_sub_epi32(a.v, b.v)};
+}
+inline i32x8 operator*(i32x8 a, i32x8 b) {
+  return {_mm256_mullo_epi32(a.v, b.v)};
+}
+inline i32x8 operator&(i32x8 a, i32x8 b) {
+  return {_mm256_and_si256(a.v, b.v)};
+}
+inline i32x8 operator|(i32x8 a, i32x8 b) {
+  return {_mm256_or_si256(a.v, b.v)};
+}
+inline f32x8 equal(i32x8 a, i32x8 b) {
+  return {_mm256_castsi256_ps(_mm256_cmpeq_epi32(a.v, b.v))};
+}
+template <int n> inline i32x8 shl(i32x8 a) {
+  return {_mm256_slli_epi32(a.v, n)};
+}
+template <int n> inline i32x8 shr(i32x8 a) {
+  return {_mm256_srli_epi32(a.v, n)};
+}
+// each lane shifted by its own count
+inline i32x8 shr(i32x8 a, i32x8 n) { return {_mm256_srlv_epi32(a.v, n.v)}; }
+// p[idx] for every lane
+inline f32x8 gather(const float *p, i32x8 idx) {
+  return {_mm256_i32gather_ps(p, idx.v, 4)};
+}
+inline i32x8 gather(const int32_t *p, i32x8 idx) {
+  return {_mm256_i32gather_epi32(p, idx.v, 4)};
+}
+
+#elif defined(__SSE2__)
+
+struct f32x8 {
+  __m128 lo, hi;
+};
+struct i32x8 {
+  __m128i lo, hi;
+};
+
+inline f32x8 splat(float f) { return {_mm_set1_ps(f), _mm_set1_ps(f)}; }
+inline i32x8 splat_i(int i) { return {_mm_set1_epi32(i), _mm_set1_epi32(i)}; }
+inline f32x8 ramp() {
+  return {_mm_setr_ps(0, 1, 2, 3), _mm_setr_ps(4, 5, 6, 7)};
+}
+inline f32x8 load(const float *p) {
+  return {_mm_loadu_ps(p), _mm_loadu_ps(p + 4)};
+}
+inline i32x8 load(const int32_t *p) {
+  return {_mm_loadu_si128((const __m128i *)p),
+          _mm_loadu_si128((const __m128i *)(p + 4))};
+}
+inline void store(float *p, f32x8 a) {
+  _mm_storeu_ps(p, a.lo);
+  _mm_storeu_ps(p + 4, a.hi);
+}
+inline void store(int32_t *p, i32x8 a) {
+  _mm_storeu_si128((__m128i *)p, a.lo);
+  _mm_storeu_si128((__m128i *)(p + 4), a.hi);
+}
+// masked lanes only; the others are neither read nor written
+inline f32x8 load(const float *p, f32x8 mask) {
+  alignas(16) float tmp[8] = {};
+  int m = _mm_movemask_ps(mask.lo) | _mm_movemask_ps(mask.hi) << 4;
+  for (int i = 0; i < 8; ++i)
+    if (m >> i & 1)
+      tmp[i] = p[i];
+  return {_mm_load_ps(tmp), _mm_load_ps(tmp + 4)};
+}
+inline void store(float *p, f32x8 a, f32x8 mask) {
+  alignas(16) float tmp[8];
+  _mm_store_ps(tmp, a.lo);
+  _mm_store_ps(tmp + 4, a.hi);
+  int m = _mm_movemask_ps(mask.lo) | _mm_movemask_ps(mask.hi) << 4;
+  for (int i = 0; i < 8; ++i)
+    if (m >> i & 1)
+      p[i] = tmp[i];
+}
+
+#define SIMD_SSE2_BINARY(type, name, intrinsic)                                \
+  inline type name(type a, type b) {                                           \
+    return {intrinsic(a.lo, b.lo), intrinsic(a.hi, b.hi)};                     \
+  }
+SIMD_SSE2_BINARY(f32x8, operator+, _mm_add_ps)
+SIMD_SSE2_BINARY(f32x8, operator-, _mm_sub_ps)
+SIMD_SSE2_BINARY(f32x8, operator*, _mm_mul_ps)
+SIMD_SSE2_BINARY(f32x8, operator/, _mm_div_ps)
+SIMD_SSE2_BINARY(f32x8, min, _mm_min_ps)
+SIMD_SSE2_BINARY(f32x8, max, _mm_max_ps)
+SIMD_SSE2_BINARY(f32x8, operator<, _mm_cmplt_ps)
+SIMD_SSE2_BINARY(f32x8, operator<=, _mm_cmple_ps)
+SIMD_SSE2_BINARY(f32x8, operator>, _mm_cmpgt_ps)
+SIMD_SSE2_BINARY(f32x8, operator>=, _mm_cmpge_ps)
+SIMD_SSE2_BINARY(f32x8, operator&, _mm_and_ps)
+SIMD_SSE2_BINARY(f32x8, operator|, _mm_or_ps)
+SIMD_SSE2_BINARY(i32x8, operator+, _mm_add_epi32)
+SIMD_SSE2_BINARY(i32x8, operator-, _mm_sub_epi32)
+SIMD_SSE2_BINARY(i32x8, operator&, _mm_and_si128)
+SIMD_SSE2_BINARY(i32x8, operator|, _mm_or_si128)
+#undef SIMD_SSE2_BINARY
+
+inline f32x8 sqrt(f32x8 a) { return {_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)}; }
+inline f32x8 rsqrt_estimate(f32x8 a) {
+  return {_mm_rsqrt_ps(a.lo), _mm_rsqrt_ps(a.hi)};
+}
+// lanes of b where mask is set, a elsewhere
+inline f32x8 select(f32x8 mask, f32x8 b, f32x8 a) {
+  return {_mm_or_ps(_mm_and_ps(mask.lo, b.lo), _mm_andnot_ps(mask.lo, a.lo)),
+          _mm_or_ps(_mm_and_ps(mask.hi, b.hi), _mm_andnot_ps(mask.hi, a.hi))};
+}
+inline int bits(f32x8 mask) {
+  return _mm_movemask_ps(mask.lo) | _mm_movemask_ps(mask.hi) << 4;
+}
+
+inline i32x8 to_int(f32x8 a) {
+  return {_mm_cvttps_epi32(a.lo), _mm_cvttps_epi32(a.hi)};
+}
+inline f32x8 to_float(i32x8 a) {
+  return {_mm_cvtepi32_ps(a.lo), _mm_cvtepi32_ps(a.hi)};
+}
+inline i32x8 as_int(f32x8 a) {
+  return {_mm_castps_si128(a.lo), _mm_castps_si128(a.hi)};
+}
+inline f32x8 as_float(i32x8 a) {
+  return {_mm_castsi128_ps(a.lo), _mm_castsi128_ps(a.hi)};
+}
+inline f32x8 equal(i32x8 a, i32x8 b) {
+  return as_float({_mm_cmpeq_epi32(a.lo, b.lo), _mm_cmpeq_epi32(a.hi, b.hi)});
+}
+// SSE2 has no 32-bit low multiply, so go through memory
+inline i32x8 operator*(i32x8 a, i32x8 b) {
+  alignas(16) int32_t x[8], y[8];
+  store(x, a);
+  store(y, b);
+  for (int i = 0; i < 8; ++i)
+    x[i] *= y[i];
+  return {_mm_load_si128((__m128i *)x), _mm_load_si128((__m128i *)(x + 4))};
+}
+// no SSE2 round instruction: truncate, then step down where that rounded up
+inline f32x8 floor(f32x8 a) {
+  f32x8 t = to_float(to_int(a));
+  return t - (select(t > a, splat(1), splat(0)));
+}
+template <int n> inline i32x8 shl(i32x8 a) {
+  return {_mm_slli_epi32(a.lo, n), _mm_slli_epi32(a.hi, n)};
+}
+template <int n> inline i32x8 shr(i32x8 a) {
+  return {_mm_srli_epi32(a.lo, n), _mm_srli_epi32(a.hi, n)};
+}
+// each lane shifted by its own count, one at a time before AVX2
+inline i32x8 shr(i32x8 a, i32x8 n) {
+  alignas(16) int32_t v[8], s[8];
+  store(v, a);
+  store(s, n);
+  for (int i = 0; i < 8; ++i)
+    v[i] = int32_t(uint32_t(v[i]) >> s[i]);
+  return load(v);
+}
+// p[idx] for every lane, one load at a time before AVX2
+inline f32x8 gather(const float *p, i32x8 idx) {
+  alignas(16) int32_t i[8];
+  store(i, idx);
+  return {_mm_setr_ps(p[i[0]], p[i[1]], p[i[2]], p[i[3]]),
+          _mm_setr_ps(p[i[4]], p[i[5]], p[i[6]], p[i[7]])};
+}
+inline i32x8 gather(const int32_t *p, i32x8 idx) {
+  alignas(16) int32_t i[8];
+  store(i, idx);
+  return {_mm_setr_epi32(p[i[0]], p[i[1]], p[i[2]], p[i[3]]),
+          _mm_setr_epi32(p[i[4]], p[i[5]], p[i[6]], p[i[7]])};
+}
+
+#else
+
+struct f32x8 {
+  float v[8];
+};
+struct i32x8 {
+  int32_t v[8];
+};
+
+#define SIMD_LANES(type, expr)                                                 \
+  type r;                                                                      \
+  for (int i = 0; i < 8; ++i)                                                  \
+    r.v[i] = expr;                                                             \
+  return r;
+#define SIMD_MASK(cond) ((cond) ? as_float_lane(-1) : 0.0f)
+
+inline float as_float_lane(int32_t i) {
+  float f;
+  std::memcpy(&f, &i, sizeof f);
+  return f;
+}
+inline int32_t as_int_lane(float f) {
+  int32_t i;
+  std::memcpy(&i, &f, sizeof i);
+  return i;
+}
+
+inline f32x8 splat(float f) { SIMD_LANES(f32x8, f) }
+inline i32x8 splat_i(int n) { SIMD_LANES(i32x8, n) }
+inline f32x8 ramp() { SIMD_LANES(f32x8, float(i)) }
+inline f32x8 load(const float *p) { SIMD_LANES(f32x8, p[i]) }
+inline i32x8 load(const int32_t *p) { SIMD_LANES(i32x8, p[i]) }
+inline void store(float *p, f32x8 a) { std::memcpy(p, a.v, sizeof a.v); }
+inline void store(int32_t *p, i32x8 a) { std::memcpy(p, a.v, sizeof a.v); }
+// masked lanes only; the others are neither read nor written
+inline f32x8 load(const float *p, f32x8 mask) {
+  SIMD_LANES(f32x8, as_int_lane(mask.v[i]) ? p[i] : 0.0f)
+}
+inline void store(float *p, f32x8 a, f32x8 mask) {
+  for (int i = 0; i < 8; ++i)
+    if (as_int_lane(mask.v[i]))
+      p[i] = a.v[i];
+}
+
+inline f32x8 operator+(f32x8 a, f32x8 b) { SIMD_LANES(f32x8, a.v[i] + b.v[i]) }
+inline f32x8 operator-(f32x8 a, f32x8 b) { SIMD_LANES(f32x8, a.v[i] - b.v[i]) }
+inline f32x8 operator*(f32x8 a, f32x8 b) { SIMD_LANES(f32x8, a.v[i] * b.v[i]) }
+inline f32x8 operator/(f32x8 a, f32x8 b) { SIMD_LANES(f32x8, a.v[i] / b.v[i]) }
+// operand order matches minps/maxps: a NaN in a yields b
+inline f32x8 min(f32x8 a, f32x8 b) {
+  SIMD_LANES(f32x8, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+}
+inline f32x8 max(f32x8 a, f32x8 b) {
+  SIMD_LANES(f32x8, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+}
+inline f32x8 sqrt(f32x8 a) { SIMD_LANES(f32x8, std::sqrt(a.v[i])) }
+inline f32x8 rsqrt_estimate(f32x8 a) {
+  SIMD_LANES(f32x8, 1.0f / std::sqrt(a.v[i]))
+}
+inline f32x8 floor(f32x8 a) { SIMD_LANES(f32x8, std::floor(a.v[i])) }
+
+inline f32x8 operator<(f32x8 a, f32x8 b) {
+  SIMD_LANES(f32x8, SIMD_MASK(a.v[i] < b.v[i]))
+}
+inline f32x8 operator<=(f32x8 a, f32x8 b) {
+  SIMD_LANES(f32x8, SIMD_MASK(a.v[i] <= b.v[i]))
+}
+inline f32x8 operator>(f32x8 a, f32x8 b) {
+  SIMD_LANES(f32x8, SIMD_MASK(a.v[i] > b.v[i]))
+}
+inline f32x8 operator>=(f32x8 a, f32x8 b) {
+  SIMD_LANES(f32x8, SIMD_MASK(a.v[i] >= b.v[i]))
+}
+inline f32x8 operator&(f32x8 a, f32x8 b) {
+  SIMD_LANES(f32x8, as_float_lane(as_int_lane(a.v[i]) & as_int_lane(b.v[i])))
+}
+inline f32x8 operator|(f32x8 a, f32x8 b) {
+  SIMD_LANES(f32x8, as_float_lane(as_int_lane(a.v[i]) | as_int_lane(b.v[i])))
+}
+// lanes of b where mask is set, a elsewhere
+inline f32x8 select(f32x8 mask, f32x8 b, f32x8 a) {
+  SIMD_LANES(f32x8, as_int_lane(mask.v[i]) ? b.v[i] : a.v[i])
+}
+inline int bits(f32x8 mask) {
+  int r = 0;
+  for (int i = 0; i < 8; ++i)
+    r |= (as_int_lane(mask.v[i]) < 0) << i;
+  return r;
+}
+
+inline i32x8 to_int(f32x8 a) { SIMD_LANES(i32x8, int32_t(a.v[i])) }
+inline f32x8 to_float(i32x8 a) { SIMD_LANES(f32x8, float(a.v[i])) }
+inline i32x8 as_int(f32x8 a) { SIMD_LANES(i32x8, as_int_lane(a.v[i])) }
+inline f32x8 as_float(i32x8 a) { SIMD_LANES(f32x8, as_float_lane(a.v[i])) }
+inline i32x8 operator+(i32x8 a, i32x8 b) { SIMD_LANES(i32x8, a.v[i] + b.v[i]) }
+inline i32x8 operator-(i32x8 a, i32x8 b) { SIMD_LANES(i32x8, a.v[i] - b.v[i]) }
+inline i32x8 operator*(i32x8 a, i32x8 b) { SIMD_LANES(i32x8, a.v[i] * b.v[i]) }
+inline i32x8 operator&(i32x8 a, i32x8 b) { SIMD_LANES(i32x8, a.v[i] & b.v[i]) }
+inline i32x8 operator|(i32x8 a, i32x8 b) { SIMD_LANES(i32x8, a.v[i] | b.v[i]) }
+inline f32x8 equal(i32x8 a, i32x8 b) {
+  SIMD_LANES(f32x8, SIMD_MASK(a.v[i] == b.v[i]))
+}
+template <int n> inline i32x8 shl(i32x8 a) {
+  SIMD_LANES(i32x8, int32_t(uint32_t(a.v[i]) << n))
+}
+template <int n> inline i32x8 shr(i32x8 a) {
+  SIMD_LANES(i32x8, int32_t(uint32_t(a.v[i]) >> n))
+}
+// each lane shifted by its own count
+inline i32x8 shr(i32x8 a, i32x8 n) {
+  SIMD_LANES(i32x8, int32_t(uint32_t(a.v[i]) >> n.v[i]))
+}
+// p[idx] for every lane
+inline f32x8 gather(const float *p, i32x8 idx) {
+  SIMD_LANES(f32x8, p[idx.v[i]])
+}
+inline i32x8 gather(const int32_t *p, i32x8 idx) {
+  SIMD_LANES(i32x8, p[idx.v[i]])
+}
+
+#undef SIMD_MASK
+#undef SIMD_LANES
+
+#endif
+
+inline f32x8 &operator+=(f32x8 &a, f32x8 b) { return a = a + b; }
+// NaN lanes clamp to lo
+inline f32x8 clamp(f32x8 a, f32x8 lo, f32x8 hi) { return min(max(a, lo), hi); }
+
+// 1/sqrt(a): the hardware estimate refined by one Newton-Raphson step,
+// relative error around 1e-7 instead of a sqrt and a divide
+inline f32x8 rsqrt(f32x8 a) {
+  f32x8 r = rsqrt_estimate(a);
+  return r * (splat(1.5f) - splat(0.5f) * a * r * r);
+}
+
+// log2 of positive lanes: exponent from the bits, mantissa in [1, 2) through
+// a degree-6 fit of log2(1 + t) / t, absolute error below 1.5e-6
+inline f32x8 log2(f32x8 x) {
+  i32x8 i = as_int(x);
+  f32x8 e = to_float(shr<23>(i) - splat_i(127));
+  f32x8 t = as_float((i & splat_i(0x007fffff)) | splat_i(0x3f800000)) - splat(1);
+  f32x8 p = splat(0.020490589f);
+  p = p * t + splat(-0.096067369f);
+  p = p * t + splat(0.215590358f);
+  p = p * t + splat(-0.339249104f);
+  p = p * t + splat(0.477706403f);
+  p = p * t + splat(-0.721162796f);
+  p = p * t + splat(1.442693233f);
+  return e + p * t;
+}
+
+// 2^x, clamped below so the exponent never leaves the normal range.
+// degree-5 fit on the fraction, relative error below 1.1e-7
+inline f32x8 exp2(f32x8 x) {
+  x = max(x, splat(-126.0f));
+  f32x8 fl = floor(x), f = x - fl;
+  f32x8 p = splat(0.0018951086f);
+  p = p * f + splat(0.0089462250f);
+  p = p * f + splat(0.0558632575f);
+  p = p * f + splat(0.2401407808f);
+  p = p * f + splat(0.6931546330f);
+  p = p * f + splat(0.9999998808f);
+  return as_float(as_int(p) + shl<23>(to_int(fl)));
+}
+
+// x^y for x >= 0 and y >= 0, with powf's 0^0 = 1
+inline f32x8 pow(f32x8 x, f32x8 y) {
+  f32x8 at_zero = select(y > splat(0), splat(0), splat(1));
+  return select(x > splat(0), exp2(y * log2(x)), at_zero);
+}
+
+} // namespace simd